@@ -0,0 +1,99 @@
+#!/bin/sh
+
+## Run clight against a fake clightd (fake_clightd.py) on a private bus, with a synthetic frame source,
+## no X (no dimmer nor dpms), no geoclue and no upower: only capture, gamma, stream, pressure, energy,
+## inhibit and hooks paths are covered, under whatever state (day, night, event) wall clock time gives.
+##
+## Modes:
+## --smoke   (default) run for CHECK_TIME seconds (60 by default) and fail unless clight starts,
+##           runs and exits cleanly. Counters are printed, but too short a run cannot be judged.
+## --check   run for an hour (budgets are only judged after 1h of uptime), then fail if any per day
+##           counter exceeds its budget, if no budget is recorded, or if run was too short.
+## --record  same hour long run, then rewrite budget file values from its per day counters,
+##           times BUDGET_MARGIN (1.5 by default).
+## Hour long runs sleep STARTUP_MARGIN more seconds (30 by default), as counting starts after modules init.
+## Lock and log files are still placed in your home: stop any running clight first.
+##
+## Usage: check_budget.sh <clight binary> <budget file> [--smoke|--check|--record]
+## Needs dbus-daemon, python3 dbus and gi modules.
+
+set -e
+
+CLIGHT=$1
+BUDGET=$2
+MODE=${3:---smoke}
+STARTUP_MARGIN=${STARTUP_MARGIN:-30}
+BUDGET_MARGIN=${BUDGET_MARGIN:-1.5}
+BUDGET_MIN_UPTIME=3600
+COUNTERS="wakeups poll timerfd_settime read bus_sent bus_process"
+
+if [ ! -x "$CLIGHT" ] || [ ! -f "$BUDGET" ]; then
+    echo "Usage: $0 <clight binary> <budget file> [--smoke|--check|--record]" >&2
+    exit 1
+fi
+
+case "$MODE" in
+    --smoke)
+        RUN_TIME=${CHECK_TIME:-60}
+        ;;
+    --check)
+        RUN_TIME=$((BUDGET_MIN_UPTIME + STARTUP_MARGIN))
+        BUDGET_OPT="--budget=$BUDGET"
+        ;;
+    --record)
+        RUN_TIME=$((BUDGET_MIN_UPTIME + STARTUP_MARGIN))
+        ;;
+    *)
+        echo "Usage: $0 <clight binary> <budget file> [--smoke|--check|--record]" >&2
+        exit 1
+        ;;
+esac
+
+TMP=$(mktemp -d)
+cleanup() {
+    kill $CLIGHTD_PID $DBUS_PID 2>/dev/null || true
+    rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+## Private bus acts as both system (clightd) and session (inhibit) bus
+dbus-daemon --session --address="unix:path=$TMP/bus" --fork --print-pid > "$TMP/dbus.pid"
+DBUS_PID=$(cat "$TMP/dbus.pid")
+export DBUS_SYSTEM_BUS_ADDRESS="unix:path=$TMP/bus"
+export DBUS_SESSION_BUS_ADDRESS="unix:path=$TMP/bus"
+
+python3 "$(dirname "$0")/fake_clightd.py" &
+CLIGHTD_PID=$!
+sleep 1
+
+## Do not read user config, nor write user cache; gamma is enabled even without X
+export XDG_CONFIG_HOME="$TMP" XDG_CACHE_HOME="$TMP" XDG_RUNTIME_DIR="$TMP" XDG_SESSION_TYPE=x11
+unset DISPLAY
+
+echo "Running clight for ${RUN_TIME}s..."
+"$CLIGHT" --frame_source=synth:ramp --lat=45.46 --lon=9.19 $BUDGET_OPT > "$TMP/clight.out" 2>&1 &
+CLIGHT_PID=$!
+sleep "$RUN_TIME"
+if ! kill -TERM "$CLIGHT_PID" 2>/dev/null; then
+    echo "clight exited before end of run:" >&2
+    cat "$TMP/clight.out" >&2
+    exit 1
+fi
+STATUS=0
+wait "$CLIGHT_PID" || STATUS=$?
+
+sed -n '/^Counters after/,$p' "$TMP/clight.out"
+
+if [ "$MODE" = "--record" ]; then
+    for c in $COUNTERS; do
+        PER_DAY=$(sed -n "s/^\* $c: [0-9]* (\([0-9]*\)\/day)$/\1/p" "$TMP/clight.out")
+        if [ -z "$PER_DAY" ]; then
+            echo "No $c counter found in clight output." >&2
+            exit 1
+        fi
+        VAL=$(awk -v v="$PER_DAY" -v m="$BUDGET_MARGIN" 'BEGIN { b = v * m; printf "%d", b == int(b) ? b : int(b) + 1 }')
+        sed -i "s/^#* *$c = .*/$c = $VAL;/" "$BUDGET"
+        echo "$c budget: $VAL/day (baseline $PER_DAY/day)"
+    done
+fi
+exit $STATUS
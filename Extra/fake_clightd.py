@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+
+## Minimal clightd stand-in, used by check_budget.sh on a private bus:
+## it only implements backlight and gamma methods clight calls, backed by plain variables.
+## Webcam is not needed, as clight is run with a synthetic frame source.
+
+import dbus
+import dbus.service
+import dbus.mainloop.glib
+from gi.repository import GLib
+
+NAME = "org.clightd.backlight"
+PATH = "/org/clightd/backlight"
+MAX_BRIGHTNESS = 100
+
+
+class Backlight(dbus.service.Object):
+    def __init__(self, bus):
+        super().__init__(bus, PATH)
+        self.brightness = MAX_BRIGHTNESS // 2
+        self.gamma = 6500
+
+    @dbus.service.method(NAME, in_signature="s", out_signature="i")
+    def getmaxbrightness(self, syspath):
+        return MAX_BRIGHTNESS
+
+    @dbus.service.method(NAME, in_signature="s", out_signature="i")
+    def getbrightness(self, syspath):
+        return self.brightness
+
+    @dbus.service.method(NAME, in_signature="si", out_signature="i")
+    def setbrightness(self, syspath, value):
+        self.brightness = max(0, min(MAX_BRIGHTNESS, value))
+        return self.brightness
+
+    @dbus.service.method(NAME, in_signature="si", out_signature="d")
+    def captureframes(self, device, frames):
+        return 0.5
+
+    @dbus.service.method(NAME, in_signature="ss", out_signature="i")
+    def getgamma(self, display, xauthority):
+        return self.gamma
+
+    @dbus.service.method(NAME, in_signature="ssi", out_signature="i")
+    def setgamma(self, display, xauthority, temp):
+        self.gamma = temp
+        return self.gamma
+
+
+if __name__ == "__main__":
+    dbus.mainloop.glib.DBusGMainLoop(set_as_default=True)
+    bus = dbus.SystemBus()
+    name = dbus.service.BusName(NAME, bus)
+    backlight = Backlight(bus)
+    GLib.MainLoop().run()
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "log.h"
+
+#define MAX_PRODUCERS 8             // max number of producers for a single output
+
+/* Producers priorities: higher priority targets are merged later, on top of lower priority ones */
+#define AMBIENT_PRIORITY 0
+#define DIMMER_PRIORITY 10
+
+/* List of outputs handled by arbiter */
+enum outputs { BACKLIGHT_OUTPUT, SIZE_OUTPUTS };
+
+/*
+ * How a producer target is combined with the ones of lower priority producers:
+ * OVERRIDE replaces it, MIN/MAX cap it from above/below, BIAS is added to it.
+ */
+enum combinators { COMBINE_OVERRIDE, COMBINE_MIN, COMBINE_MAX, COMBINE_BIAS };
+
+typedef int (*output_apply)(double value);
+
+void init_output(enum outputs o, const char *name, output_apply apply);
+int add_producer(enum outputs o, const char *name, int priority, enum combinators c);
+void set_output_target(enum outputs o, int producer, double value);
+void clear_output_target(enum outputs o, int producer);
+double get_output_value(enum outputs o);
+void flush_outputs(void);
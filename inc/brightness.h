@@ -1,4 +1,6 @@
 #include "bus.h"
 
 void init_brightness(void);
+void request_capture(void);
+void restore_brightness(void);
 void destroy_brightness(void);
@@ -4,6 +4,9 @@
 
 #include "utils.h"
 
+#define BUS_TIMEOUT (2 * 1000 * 1000)       // default timeout for method calls (getters and setters), in usec
+#define SHUTDOWN_TIMEOUT (3 * 1000 * 1000)  // whole shutdown time budget, in usec
+
 /*
  * Object wrapper for bus calls
  */
@@ -12,14 +15,22 @@ struct bus_args {
     const char *path;
     const char *interface;
     const char *member;
+    uint64_t timeout;                       // method call timeout in usec; if 0, BUS_TIMEOUT is used
 };
 
 sd_bus *bus;
 
 void init_bus(void);
-void bus_call(void *userptr, const char *userptr_type, const struct bus_args *args, const char *signature, ...);
+int bus_call(void *userptr, const char *userptr_type, const struct bus_args *args, const char *signature, ...);
+int bus_send(const struct bus_args *a);
 void add_match(const struct bus_args *a, sd_bus_message_handler_t cb);
-void set_property(const struct bus_args *a, const char type, const char *value);
-void get_property(const struct bus_args *a, const char *type, void *userptr);
+int set_property(const struct bus_args *a, const char type, const char *value);
+int get_property(const struct bus_args *a, const char *type, void *userptr);
+int bus_process(void);
+void dispatch_bus_signals(void);
+void set_bus_deadline(uint64_t budget);
+void reset_bus_deadline(void);
+void set_shutdown_deadline(uint64_t budget);
+int shutdown_deadline_expired(void);
 int check_err(int r, sd_bus_error *err);
 void destroy_bus(void);
@@ -0,0 +1,11 @@
+#include "log.h"
+
+int get_camera_color_temp(void);
+const char *camera_sysname(void);
+const double *get_roi(const char *device);
+int is_full_roi(const double *roi);
+int set_camera_crop(int fd, const double *roi);
+void set_camera_roi(int enable);
+int set_power_line_frequency(int fd, int hz);
+int set_camera_power_line(int hz);
+void close_camera(void);
@@ -0,0 +1,4 @@
+#include "log.h"
+
+int find_city(const char *query, double *lat, double *lon);
+const char *nearest_city_country(double lat, double lon);
@@ -18,7 +18,7 @@
 #define DONT_POLL_W_ERR -3          // avoid polling a module because an error occurred (used in location.c when no geoclue2 is found)
 
 /* List of modules indexes */
-enum modules { CAPTURE_IX, LOCATION_IX, GAMMA_IX, SIGNAL_IX, DPMS_IX, MODULES_NUM };
+enum modules { CAPTURE_IX, LOCATION_IX, GAMMA_IX, SIGNAL_IX, DPMS_IX, STREAM_IX, PRESSURE_IX, ENERGY_IX, DIMMER_IX, UPOWER_IX, INHIBIT_IX, HOOKS_IX, MODULES_NUM };
 /*
  * List of states clight can be through: 
  * day between sunrise and sunset
@@ -28,9 +28,33 @@ enum modules { CAPTURE_IX, LOCATION_IX, GAMMA_IX, SIGNAL_IX, DPMS_IX, MODULES_NU
  */
 enum states { UNKNOWN, DAY, NIGHT, EVENT, SIZE_STATES };
 
+#define MAX_HOOKS 16                // max number of user event hooks
+#define HOOK_CMD_MAX 512            // max length of a hook command
+#define HOOK_TIMEOUT 30             // default seconds after which a hook gets killed
+#define MAX_ROIS 8                  // max number of per device ambient regions of interest
+
+/* List of power sources */
+enum ac_states { ON_AC, ON_BATTERY, SIZE_AC };
+
 /* List of events: sunrise and sunset */
 enum events { SUNRISE, SUNSET, SIZE_EVENTS };
 
+/* A command to be run whenever an internal event (eg: "state") happens */
+struct hook_conf {
+    char event[32];
+    char command[HOOK_CMD_MAX];
+    int timeout;                    // seconds after which command gets killed
+};
+
+/*
+ * Region of webcam view used to estimate ambient brightness, for a device (eg: "video0" or "default"),
+ * as fractions of the whole view: x, y, width, height.
+ */
+struct roi_conf {
+    char device[32];
+    double roi[4];
+};
+
 /* Struct that holds global config as passed through cmdline args */
 struct config {
     int num_captures;               // number of frame captured for each screen brightness compute
@@ -42,8 +66,36 @@ struct config {
     int no_smooth_transition;       // disable smooth transitions for gamma
     double lat;                     // latitude
     double lon;                     // longitude
+    double roi[4];                  // ambient region of interest for any device (unset if its width is 0)
+    struct roi_conf rois[MAX_ROIS]; // per device ambient regions of interest (only from config file)
+    int num_rois;
+    char frame_source[PATH_MAX + 1]; // fake camera used instead of webcam (disabled if empty), see frames.c
+    int no_flicker;                 // disable light flicker detection and webcam anti flicker setting
+    char city[64];                  // city whose location is used if no lat/lon are set (eg: "rome" or "san jose,US")
     char events[SIZE_EVENTS][10];      // sunrise/sunset times passed from cmdline opts (if setted, location module won't be started)
     int no_gamma;                   // disable gamma support (if setted, gamma and location modules won't be started)
+    double drop_limit;              // brightness drop (between 0 and 1) that triggers a fast recapture
+    char trace_file[PATH_MAX + 1];  // file where to record every ambient brightness capture (disabled if empty)
+    char tune_file[PATH_MAX + 1];   // recorded trace to be replayed by parameters tuner (disabled if empty)
+    char budget_file[PATH_MAX + 1]; // per day syscalls budgets checked on exit (disabled if empty)
+    char evaluate_dir[PATH_MAX + 1]; // labeled frames dataset estimators are evaluated on (disabled if empty)
+    int tune_samples;               // number of random configurations tried by tuner (0 for grid search)
+    int pressure_threshold;         // percentage of stall time over which system is considered under pressure
+    int max_pressure_deferral;      // max seconds captures and gamma transitions can be deferred because of pressure
+    int no_pressure;                // disable system pressure awareness
+    int no_dead_reckoning;          // disable dead reckoned backlight updates between captures
+    int restore_on_exit;            // restore initial backlight level and neutral screen temperature when leaving
+    int no_dimmer;                  // disable screen dimmer
+    int dimmer_timeout;             // seconds of user inactivity after which screen is dimmed
+    double dimmer_pct;              // backlight level (between 0 and 1) used while dimmed
+    double ambient_gamma_weight;    // how much ambient light color temperature weighs on screen temperature (0 to disable)
+    int capture_freshness;          // seconds a capture result can be reused for, instead of capturing again
+    int no_inhibit;                 // disable org.freedesktop.ScreenSaver inhibit support
+    struct hook_conf hooks[MAX_HOOKS]; // user event hooks (only from config file)
+    int num_hooks;
+    int hooks_concurrency;          // max number of hooks running at same time
+    int manage_dpms;                // set dpms timeouts depending on state and power source
+    int dpms_timeouts[SIZE_AC][SIZE_STATES]; // dpms timeout for each power source and state
 };
 
 /* Global state of program */
@@ -4,3 +4,4 @@ enum CONFIG { GLOBAL, LOCAL };
 
 // void setup_config(void);
 void read_config(enum CONFIG file);
+int read_budget(const char *path, const char *const names[], int num, double *budget);
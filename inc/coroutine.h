@@ -0,0 +1,34 @@
+#include "utils.h"
+
+/*
+ * Stackless coroutines (protothreads): a coroutine is a function that can return at an await point
+ * and, when called again, resumes right after it. Only its resume point is saved:
+ * locals do not survive an await, so any state must live in static (or module) variables.
+ * No thread nor stack per coroutine, and no allocation: main poll stays single threaded.
+ *
+ * A coroutine is resumed by its module whenever something it may be waiting on happened
+ * (its timer expired, an event was dispatched).
+ * It returns CO_WAITING while suspended, CO_DONE once it reached CO_END.
+ *
+ * Built on a switch statement: CO_* macros cannot be used inside another switch in coroutine body,
+ * and there can be at most one await point per source line.
+ */
+struct coroutine {
+    int line;                       // resume point; 0 if not running
+};
+
+enum co_states { CO_DONE, CO_WAITING };
+
+#define CO_BEGIN(co) switch ((co)->line) { case 0:
+#define CO_END(co) } (co)->line = 0; return CO_DONE
+
+/* Suspend; next resume continues from here */
+#define CO_YIELD(co) do { (co)->line = __LINE__; return CO_WAITING; case __LINE__:; } while (0)
+
+/* Suspend until cond holds; it is checked again each time coroutine is resumed */
+#define CO_AWAIT(co, cond) do { (co)->line = __LINE__; case __LINE__: if (!(cond)) return CO_WAITING; } while (0)
+
+/* Arm timerfd fd and suspend: module resumes coroutine once fd expires */
+#define CO_SLEEP(co, fd, sec, nsec) do { set_timeout(sec, nsec, fd, 0); CO_YIELD(co); } while (0)
+
+#define CO_RUNNING(co) ((co)->line != 0)
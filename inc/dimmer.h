@@ -0,0 +1,5 @@
+#include "bus.h"
+
+void init_dimmer(void);
+int is_dimmed(void);
+void destroy_dimmer(void);
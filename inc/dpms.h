@@ -1,4 +1,5 @@
 #include "utils.h"
+#include <xcb/xcb.h>
 
 void init_dpms(void);
 int get_screen_dpms(void);
@@ -0,0 +1,10 @@
+#include "utils.h"
+
+/* Activities energy gets attributed to. Anything else is accounted as idle. */
+enum activities { CAPTURE_ACTIVITY, GAMMA_ACTIVITY, SIZE_ACTIVITIES };
+
+void init_energy(void);
+void energy_begin(enum activities a);
+double energy_end(enum activities a);
+void log_energy_stats(void);
+void destroy_energy(void);
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "log.h"
+
+#define MAX_SUBSCRIBERS 8           // max number of callbacks subscribed to a single event type
+
+/* List of internal event types modules can publish/subscribe to */
+enum event_types { LOCATION_CHANGED, STATE_CHANGED, AMBIENT_MEASURED, DISPLAY_POWER_CHANGED, DIMMED_CHANGED, POWER_SOURCE_CHANGED, INHIBIT_CHANGED, AMBIENT_TEMP_MEASURED, EVENT_TYPES_NUM };
+
+/*
+ * Internal event: type plus its payload.
+ * Events of same type published during same main poll iteration get coalesced:
+ * subscribers will only receive latest payload.
+ */
+struct event {
+    enum event_types type;
+    union {
+        struct {
+            double lat;
+            double lon;
+        } location;                 // LOCATION_CHANGED: new location
+        struct {
+            enum states old;
+            enum states current;
+        } state;                    // STATE_CHANGED: old and new state.time
+        double ambient;             // AMBIENT_MEASURED: ambient brightness, between 0.0 and 1.0
+        int dpms;                   // DISPLAY_POWER_CHANGED: new dpms power level
+        int dimmed;                 // DIMMED_CHANGED: whether screen is now dimmed
+        int on_battery;             // POWER_SOURCE_CHANGED: whether we are now running on battery
+        int inhibited;              // INHIBIT_CHANGED: whether screensaver is now inhibited
+        int ambient_temp;           // AMBIENT_TEMP_MEASURED: ambient light color temperature, in Kelvin
+    };
+};
+
+typedef void (*event_cb)(const struct event *ev);
+
+void subscribe_event(enum event_types type, event_cb cb);
+void publish_event(const struct event *ev);
+int dispatch_events(void);
@@ -0,0 +1,14 @@
+#include "frames.h"
+
+/* Rolling shutter banding accumulated over frames of a capture */
+struct flicker_detector {
+    double power[2];                // banding power at 100Hz and 120Hz light flicker (ie: 50Hz and 60Hz mains)
+    double noise;                   // banding power at off-mains frequencies
+    int frames;
+};
+
+void flicker_add_frame(struct flicker_detector *d, const struct frame *f);
+int flicker_result(const struct flicker_detector *d);
+void set_camera_flicker(void);
+int set_source_flicker(struct frame_source *src, const char *device);
+void end_source_flicker(struct frame_source *src, const struct flicker_detector *d);
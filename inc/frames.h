@@ -0,0 +1,30 @@
+#pragma once
+
+#include "log.h"
+
+/* Supported pixel formats: only luma is used */
+enum frame_formats { GREY_FMT, YUYV_FMT };
+
+/*
+ * A single frame; its data is owned by the frame source
+ * and is only valid until next frame is requested.
+ */
+struct frame {
+    const uint8_t *data;
+    int width;
+    int height;
+    enum frame_formats fmt;
+    double fps;                     // frames per second source is producing, 0 if unknown
+};
+
+struct frame_source;
+
+struct frame_source *open_frame_source(const char *spec);
+int next_frame(struct frame_source *src, struct frame *f, int timeout);
+double frame_brightness(const struct frame *f);
+double frame_roi_brightness(const struct frame *f, const double *roi);
+int frame_rgb_mean(const struct frame *f, double *rgb);
+int rgb_color_temp(const double *rgb);
+const double *get_source_roi(const struct frame_source *src);
+void set_source_power_line(struct frame_source *src, int hz);
+void close_frame_source(struct frame_source *src);
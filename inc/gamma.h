@@ -1,4 +1,6 @@
 #include "bus.h"
 
 void init_gamma(void);
+double get_sun_elevation(time_t t, const double lat, const double lon);
+void restore_gamma(void);
 void destroy_gamma(void);
@@ -0,0 +1,5 @@
+#include "utils.h"
+
+void fork_hooks_helper(void);
+void init_hooks(void);
+void destroy_hooks(void);
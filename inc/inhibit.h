@@ -0,0 +1,5 @@
+#include "bus.h"
+
+void init_inhibit(void);
+int is_inhibited(void);
+void destroy_inhibit(void);
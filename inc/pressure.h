@@ -0,0 +1,5 @@
+#include "utils.h"
+
+void init_pressure(void);
+int defer_for_pressure(time_t *since);
+void destroy_pressure(void);
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "log.h"
+
+/* What to do when capture timer expires */
+enum capture_actions { CAPTURE_DO, CAPTURE_CACHED, CAPTURE_SKIP_DPMS, CAPTURE_PAUSED, CAPTURE_DEFER };
+
+/* Capture scheduling parameters: conf ones for brightness module, tried ones for tuner */
+struct sched_params {
+    const int *timeout;             // timeout between captures for each state
+    double drop_limit;
+    int capture_freshness;
+    int dead_reckoning;             // whether dead reckoning is enabled (and location known)
+    double lat;
+    double lon;
+};
+
+/* Capture scheduler state */
+struct sched_state {
+    time_t last_capture;            // time of last successful capture, 0 if none
+    int fast_recapture;             // whether a fast recapture is pending
+    int reuse_last;                 // whether last result must be reused whatever its age (requested during that capture)
+    int captured;                   // whether a capture has already been done
+    double anchor;                  // last captured ambient brightness
+    double anchor_sky;              // predicted sky brightness when last capture happened
+    double dr_perc;                 // current dead reckoned backlight percentage
+};
+
+/* Conditions capture scheduling depends on, besides time and state */
+struct sched_env {
+    enum states state;
+    int dpms;                       // screen power level, > 0 if screen is blanked
+    int paused;                     // screen dimmed or screensaver inhibited
+    int (*under_pressure)(void);    // whether capture should be deferred because of pressure; may be NULL
+};
+
+enum capture_actions capture_action(const struct sched_params *p, const struct sched_state *s,
+                                    const struct sched_env *e, time_t now, int *timeout);
+int capture_done(const struct sched_params *p, struct sched_state *s, const struct sched_env *e,
+                 time_t now, time_t wall, double ambient, double drop);
+int capture_failed(const struct sched_params *p, struct sched_state *s, const struct sched_env *e);
+int dead_reckoning_active(const struct sched_params *p, const struct sched_state *s, enum states st);
+int dead_reckoning_step(const struct sched_params *p, struct sched_state *s, time_t wall);
+int step_timeout(const struct sched_params *p, const struct sched_state *s, enum states st, int timeout);
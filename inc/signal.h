@@ -1,4 +1,5 @@
 #include "utils.h"
 
 void init_signal(void);
+int quit_signal_pending(void);
 void destroy_signal(void);
@@ -0,0 +1,15 @@
+#include "log.h"
+
+/*
+ * Counted syscalls and wakeups: they are what keeps cpu out of deep sleep states.
+ * POLL_CNT counts both poll and epoll_wait calls; READ_CNT counts timerfd and signalfd reads.
+ */
+enum counters { WAKEUPS_CNT, POLL_CNT, TIMER_SET_CNT, READ_CNT, BUS_SENT_CNT, BUS_PROCESS_CNT, SIZE_COUNTERS };
+
+#define COUNT(c) counters[c]++
+
+extern uint64_t counters[SIZE_COUNTERS];
+
+void init_stats(void);
+void log_stats(void);
+int check_budget(void);
@@ -0,0 +1,13 @@
+#include "utils.h"
+
+/*
+ * Emit a json event to every connected event stream client.
+ * Arguments are not even evaluated if no client is connected.
+ */
+#define STREAM(type, fields, ...) do { if (stream_clients) stream_message(type, fields, ##__VA_ARGS__); } while (0)
+
+extern int stream_clients;          // number of clients currently connected to event stream socket
+
+void init_stream(void);
+void stream_message(const char *type, const char *fields, ...);
+void destroy_stream(void);
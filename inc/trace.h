@@ -0,0 +1,12 @@
+#include "log.h"
+
+/* A single recorded ambient brightness capture */
+struct trace_sample {
+    time_t t;                       // capture time
+    enum states state;              // state.time when capture happened
+    double ambient;                 // captured ambient brightness, between 0.0 and 1.0
+};
+
+void init_trace(void);
+int load_trace(const char *path, struct trace_sample **samples);
+void destroy_trace(void);
@@ -0,0 +1,3 @@
+#include "log.h"
+
+void tune(void);
@@ -0,0 +1,5 @@
+#include "bus.h"
+
+void init_upower(void);
+int on_battery(void);
+void destroy_upower(void);
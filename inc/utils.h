@@ -5,5 +5,8 @@
 
 int start_timer(int clockid, int initial_timeout);
 void set_timeout(int sec, int nsec, int fd, int flag);
+ssize_t read_timer(int fd);
+const char *get_module_name(int fd);
+time_t get_monotonic_time(void);
 void init_module(int fd, enum modules module, void (*cb)(void), void (*destroy)(void));
 void destroy_module(enum modules module);
@@ -0,0 +1,146 @@
+#include "../inc/arbiter.h"
+#include "../inc/stream.h"
+
+/*
+ * A producer of targets for an output (eg: ambient brightness loop, dimmer).
+ */
+struct producer {
+    const char *name;
+    int priority;
+    enum combinators combinator;
+    int active;                     // whether producer currently has a target
+    double target;
+};
+
+/*
+ * An output device: producers are kept sorted by ascending priority.
+ * Targets are only merged and applied by flush_outputs, once per main poll iteration,
+ * so that each output gets at most one write per iteration.
+ */
+struct output {
+    const char *name;
+    output_apply apply;
+    struct producer producers[MAX_PRODUCERS];   // indexed by producer id
+    int order[MAX_PRODUCERS];                   // producer ids, sorted by ascending priority
+    int num_producers;
+    int dirty;                      // whether any target changed since last flush
+    int applied;                    // whether value has ever been applied
+    double value;                   // last applied value
+};
+
+static double compute_target(const struct output *out);
+
+static struct output outputs[SIZE_OUTPUTS];
+
+void init_output(enum outputs o, const char *name, output_apply apply) {
+    outputs[o].name = name;
+    outputs[o].apply = apply;
+}
+
+/*
+ * Register a producer for output o; returns its id, to be used to set its targets, or -1 on error.
+ * Same priority producers are merged in registration order.
+ */
+int add_producer(enum outputs o, const char *name, int priority, enum combinators c) {
+    struct output *out = &outputs[o];
+
+    if (out->num_producers == MAX_PRODUCERS) {
+        WARN("Too many producers for %s output.\n", out->name);
+        return -1;
+    }
+    const int id = out->num_producers++;
+    out->producers[id] = (struct producer) { .name = name, .priority = priority, .combinator = c };
+
+    int i;
+    for (i = id; i > 0 && out->producers[out->order[i - 1]].priority > priority; i--) {
+        out->order[i] = out->order[i - 1];
+    }
+    out->order[i] = id;
+    return id;
+}
+
+void set_output_target(enum outputs o, int producer, double value) {
+    if (producer == -1) {
+        return;
+    }
+
+    struct producer *p = &outputs[o].producers[producer];
+    if (!p->active || p->target != value) {
+        p->active = 1;
+        p->target = value;
+        outputs[o].dirty = 1;
+    }
+}
+
+void clear_output_target(enum outputs o, int producer) {
+    if (producer != -1 && outputs[o].producers[producer].active) {
+        outputs[o].producers[producer].active = 0;
+        outputs[o].dirty = 1;
+    }
+}
+
+/*
+ * Last value applied to output o, -1 if none.
+ */
+double get_output_value(enum outputs o) {
+    return outputs[o].applied ? outputs[o].value : -1;
+}
+
+/*
+ * Merge active producers targets, from lowest to highest priority.
+ * First active producer (bias ones excluded) gives base value.
+ * Returns -1 if there is no base value.
+ */
+static double compute_target(const struct output *out) {
+    double value = -1;
+
+    for (int i = 0; i < out->num_producers; i++) {
+        const struct producer *p = &out->producers[out->order[i]];
+
+        if (!p->active || (value == -1 && p->combinator == COMBINE_BIAS)) {
+            continue;
+        }
+        if (value == -1 || p->combinator == COMBINE_OVERRIDE) {
+            value = p->target;
+            continue;
+        }
+        switch (p->combinator) {
+            case COMBINE_MIN:
+                value = fmin(value, p->target);
+                break;
+            case COMBINE_MAX:
+                value = fmax(value, p->target);
+                break;
+            case COMBINE_BIAS:
+                value += p->target;
+                break;
+            default:
+                break;
+        }
+    }
+    return value == -1 ? -1 : fmax(0.0, fmin(1.0, value));
+}
+
+/*
+ * Called by main poll once per iteration: apply new value to every output whose targets changed,
+ * only if it differs from last applied one.
+ * If apply fails, output is left dirty: it will be retried on next iteration.
+ */
+void flush_outputs(void) {
+    for (int i = 0; i < SIZE_OUTPUTS; i++) {
+        struct output *out = &outputs[i];
+
+        if (!out->dirty || !out->apply) {
+            continue;
+        }
+        double value = compute_target(out);
+        if (value < 0 || (out->applied && value == out->value)) {
+            out->dirty = 0;
+        } else if (out->apply(value) == 0) {
+            out->dirty = 0;
+            out->applied = 1;
+            out->value = value;
+            STREAM("output", "\"name\":\"%s\",\"value\":%lf", out->name, value);
+        }
+    }
+}
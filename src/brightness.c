@@ -1,12 +1,38 @@
 #include "../inc/brightness.h"
 #include "../inc/dpms.h"
+#include "../inc/event.h"
+#include "../inc/stream.h"
+#include "../inc/pressure.h"
+#include "../inc/energy.h"
+#include "../inc/gamma.h"
+#include "../inc/dimmer.h"
+#include "../inc/inhibit.h"
+#include "../inc/camera.h"
+#include "../inc/arbiter.h"
+#include "../inc/frames.h"
+#include "../inc/flicker.h"
+#include "../inc/scheduler.h"
+#include "../inc/stats.h"
+
+/* captureframes has to open webcam and grab frames: give it much more time than a simple getter/setter */
+#define CAPTURE_TIMEOUT(frames) ((5 + (frames)) * 1000 * 1000)
 
 static void brightness_cb(void);
+static void state_changed_cb(const struct event *ev);
+static void resume_cb(const struct event *ev);
 static void do_capture(void);
-static void get_max_brightness(void);
-static void get_current_brightness(void);
+static struct sched_params get_sched_params(void);
+static struct sched_env get_sched_env(void);
+static int pressure_deferral(void);
+static void use_cached_capture(void);
+static void schedule_capture(int timeout);
+static void dead_reckoning(void);
+static int get_max_brightness(void);
+static int get_current_brightness(void);
 static void set_brightness(double perc);
+static int apply_backlight(double perc);
 static double capture_frames_brightness(void);
+static double local_frames_brightness(void);
 
 /*
  * Storage struct for our needed variables.
@@ -15,110 +41,369 @@ struct brightness {
     int current;
     int max;
     int old;
+    struct sched_state sched; // capture scheduler state, see scheduler.c
+    time_t deferred_since;  // when we started deferring captures because of system pressure
+    time_t next_capture;    // CLOCK_MONOTONIC time of next capture
+    int initial;            // backlight level when we started, restored on exit if conf.restore_on_exit
+    uint64_t capture_wakeup; // main poll wakeup (see stats.h) during which last capture completed
+    double last_val;        // last captured ambient brightness
+    int frames_temp;        // color temperature of last frames from frame source, -1 if unknown
 };
 
 static struct brightness br;
+static int ambient_producer;        // our backlight arbiter producer id
+static struct frame_source *frames; // local frame source used instead of clightd, if conf.frame_source is set
 
 /*
  * Init brightness values (max and current)
  */
 void init_brightness(void) {
+    if (strlen(conf.frame_source) && !(frames = open_frame_source(conf.frame_source))) {
+        return ERROR("Failed to open frame source %s.\n", conf.frame_source);
+    }
     get_max_brightness();
+    if (conf.restore_on_exit && !conf.single_capture_mode && get_current_brightness() == 0) {
+        br.initial = br.old;
+    }
     if (!state.quit) {
         int fd = start_timer(CLOCK_MONOTONIC, 1);
         init_module(fd, CAPTURE_IX, brightness_cb, destroy_brightness);
+        init_output(BACKLIGHT_OUTPUT, "backlight", apply_backlight);
+        ambient_producer = add_producer(BACKLIGHT_OUTPUT, "ambient", AMBIENT_PRIORITY, COMBINE_OVERRIDE);
+        subscribe_event(STATE_CHANGED, state_changed_cb);
+        subscribe_event(DIMMED_CHANGED, resume_cb);
+        subscribe_event(INHIBIT_CHANGED, resume_cb);
     }
 }
 
+/*
+ * Capture timer is used for dead reckoned backlight updates too:
+ * do a capture only if its time has come.
+ */
 static void brightness_cb(void) {
     if (!conf.single_capture_mode) {
-        uint64_t t;
-        read(main_p[CAPTURE_IX].fd, &t, sizeof(uint64_t));
+        read_timer(main_p[CAPTURE_IX].fd);
+        if (br.next_capture > get_monotonic_time()) {
+            return dead_reckoning();
+        }
     }
     do_capture();
     if (conf.single_capture_mode) {
+        /* main poll won't run anymore */
+        flush_outputs();
         state.quit = 1;
     }
 }
 
+/*
+ * When we entered/left an event, set correct capture timeout for new state.
+ * Do not touch initial capture timeout, nor a pending fast recapture:
+ * they will set correct timeout themselves.
+ */
+static void state_changed_cb(const struct event *ev) {
+    if (br.sched.captured && !br.sched.fast_recapture) {
+        schedule_capture(conf.timeout[ev->state.current]);
+    }
+}
+
+/*
+ * Captures are suspended while screen is dimmed or screensaver is inhibited:
+ * once both are over, do a capture if one was due in the meantime.
+ */
+static void resume_cb(const struct event *ev) {
+    if (!is_dimmed() && !is_inhibited() && br.next_capture <= get_monotonic_time()) {
+        request_capture();
+    }
+}
+
+/*
+ * Ask for a capture as soon as possible (eg: on SIGUSR2).
+ * Capture timer is armed to fire right after current main poll iteration,
+ * so a burst of requests still leads to a single capture.
+ * Requests received while a capture was in flight (ie: while we waited for clightd) are only handled
+ * once it completed, by main poll iteration that follows it (deferred bus signals first, then signalfd):
+ * they get its result whatever capture_freshness, see use_cached_capture().
+ */
+void request_capture(void) {
+    if (!modules[CAPTURE_IX].inited) {
+        return;
+    }
+    if (br.sched.last_capture && counters[WAKEUPS_CNT] <= br.capture_wakeup + 1) {
+        br.sched.reuse_last = 1;
+    }
+    br.sched.fast_recapture = 0;
+    br.next_capture = get_monotonic_time();
+    set_timeout(0, 1, main_p[CAPTURE_IX].fd, 0);
+}
+
 /**
- * When timerfd timeout expires, check if we are in screen power_save mode,
- * otherwise start streaming on webcam and set CAMERA_IX fd of pollfd struct to
- * webcam device fd. This way our main poll will get events (frames) from webcam device too.
+ * When timerfd timeout expires, ask capture scheduler what to do (see capture_action()),
+ * then capture frames through clightd (or our frame source) and set backlight.
  */
 static void do_capture(void) {
-    static const int fast_timeout = 15;
-    static const double drop_limit = 0.6;
+    const struct sched_params p = get_sched_params();
+    const struct sched_env e = get_sched_env();
+    int timeout;
 
-    /*
-     * if screen is currently blanked thanks to dpms,
-     * do not do anything. Set a long timeout and return.
-     * Timeout will increase as screen power management goes deeper.
-     */
-    if (get_screen_dpms() > 0) {
-        INFO("Screen is currently in power saving mode. Avoid changing brightness and setting a long timeout.\n");
-        return set_timeout(2 * conf.timeout[state.time] * get_screen_dpms(), 0, main_p[CAPTURE_IX].fd, 0);
+    switch (capture_action(&p, &br.sched, &e, get_monotonic_time(), &timeout)) {
+        case CAPTURE_SKIP_DPMS:
+            INFO("Screen is currently in power saving mode. Avoid changing brightness and setting a long timeout.\n");
+            return schedule_capture(timeout);
+        case CAPTURE_PAUSED:
+            /* wait until it is over: see resume_cb */
+            INFO("%s. Delaying capture.\n", is_dimmed() ? "Screen is currently dimmed" : "Screensaver is inhibited");
+            br.next_capture = get_monotonic_time();
+            return set_timeout(0, 0, main_p[CAPTURE_IX].fd, 0);
+        case CAPTURE_DEFER:
+            INFO("System under pressure. Deferring capture.\n");
+            return schedule_capture(timeout);
+        case CAPTURE_CACHED:
+            br.deferred_since = 0;
+            br.sched.reuse_last = 0;
+            use_cached_capture();
+            return schedule_capture(timeout);
+        case CAPTURE_DO:
+            br.deferred_since = 0;
+            break;
     }
 
+    /* whole capture -> getbrightness -> setbrightness sequence shares a single time budget */
+    set_bus_deadline(CAPTURE_TIMEOUT(conf.num_captures) + BUS_TIMEOUT);
+    STREAM("capture", "\"frames\":%d", conf.num_captures);
+    energy_begin(CAPTURE_ACTIVITY);
     double val = capture_frames_brightness();
     if (!state.quit && val >= 0.0) {
+        br.capture_wakeup = counters[WAKEUPS_CNT];
         INFO("Average frames brightness: %lf.\n", val);
+        br.last_val = val;
+        struct event ev = { .type = AMBIENT_MEASURED, .ambient = val };
+        publish_event(&ev);
+        if (conf.ambient_gamma_weight > 0 && modules[GAMMA_IX].inited) {
+            /* we only see frame source frames; otherwise, webcam is still awake and its AWB converged on same frames */
+            struct event temp_ev = { .type = AMBIENT_TEMP_MEASURED, .ambient_temp = frames ? br.frames_temp : get_camera_color_temp() };
+            if (temp_ev.ambient_temp > 0) {
+                publish_event(&temp_ev);
+            }
+        }
         set_brightness(val);
-        
+        if (modules[ENERGY_IX].inited) {
+            INFO("Capture energy: %.3lf J.\n", energy_end(CAPTURE_ACTIVITY));
+        }
+
+        timeout = capture_done(&p, &br.sched, &e, get_monotonic_time(), time(NULL), val, (double)(br.current - br.old) / br.max);
         if (!conf.single_capture_mode && !state.quit) {
-            double drop = (double)(br.current - br.old) / br.max;
-            // if there is too high difference, do a fast recapture to be sure
-            // this is the correct level
-            if (fabs(drop) > drop_limit) {
-                INFO("Weird brightness drop. Recapturing in 15 seconds.\n");
-                // single call after 15s
-                set_timeout(fast_timeout, 0, main_p[CAPTURE_IX].fd, 0);
-            } else {
-                // reset normal timer
-                set_timeout(conf.timeout[state.time], 0, main_p[CAPTURE_IX].fd, 0);
+            if (br.sched.fast_recapture) {
+                INFO("Weird brightness drop. Recapturing in %d seconds.\n", timeout);
             }
+            schedule_capture(timeout);
+        }
+    } else {
+        /* a failed capture still kept camera (and system) busy */
+        energy_end(CAPTURE_ACTIVITY);
+        if (!conf.single_capture_mode && !state.quit) {
+            schedule_capture(capture_failed(&p, &br.sched, &e));
         }
     }
+    close_camera();
+    reset_bus_deadline();
+}
+
+/*
+ * Scheduler parameters are read each time: location may become known after we started.
+ */
+static struct sched_params get_sched_params(void) {
+    return (struct sched_params) {
+        .timeout = conf.timeout,
+        .drop_limit = conf.drop_limit,
+        .capture_freshness = conf.capture_freshness,
+        .dead_reckoning = !conf.no_dead_reckoning && (conf.lat != 0 || conf.lon != 0),
+        .lat = conf.lat,
+        .lon = conf.lon
+    };
+}
+
+/*
+ * Pressure is only checked if scheduler gets there: deferral time is counted from first deferred capture.
+ * Single capture mode never defers.
+ */
+static struct sched_env get_sched_env(void) {
+    return (struct sched_env) {
+        .state = state.time,
+        .dpms = get_screen_dpms(),
+        .paused = is_dimmed() || is_inhibited(),
+        .under_pressure = conf.single_capture_mode ? NULL : pressure_deferral
+    };
+}
+
+static int pressure_deferral(void) {
+    return defer_for_pressure(&br.deferred_since);
+}
+
+/*
+ * Last capture is younger than conf.capture_freshness seconds, or it was in flight when capture was requested:
+ * just reuse its result.
+ */
+static void use_cached_capture(void) {
+    const time_t age = get_monotonic_time() - br.sched.last_capture;
+
+    INFO("Using %lds old ambient brightness: %lf.\n", (long)age, br.last_val);
+    STREAM("capture_cached", "\"ambient\":%lf,\"age\":%ld", br.last_val, (long)age);
+    set_brightness(br.last_val);
+}
+
+/*
+ * Set next capture in timeout seconds.
+ * If dead reckoning is active, timer will fire every few seconds until then, see step_timeout().
+ */
+static void schedule_capture(int timeout) {
+    const struct sched_params p = get_sched_params();
+
+    br.next_capture = get_monotonic_time() + timeout;
+    set_timeout(step_timeout(&p, &br.sched, state.time, timeout), 0, main_p[CAPTURE_IX].fd, 0);
+}
+
+/*
+ * Between captures, during events, move backlight along predicted ambient brightness.
+ */
+static void dead_reckoning(void) {
+    const struct sched_params p = get_sched_params();
+    time_t now = get_monotonic_time();
+
+    if (dead_reckoning_active(&p, &br.sched, state.time) && get_screen_dpms() <= 0 && !is_dimmed() && !is_inhibited()
+        && dead_reckoning_step(&p, &br.sched, time(NULL))) {
+        INFO("Dead reckoned ambient brightness: %lf.\n", br.sched.dr_perc);
+        STREAM("dead_reckoning", "\"ambient\":%lf", br.sched.dr_perc);
+        /* no need to read backlight level: drop is only computed on captures */
+        set_output_target(BACKLIGHT_OUTPUT, ambient_producer, br.sched.dr_perc);
+    }
+
+    /* timer may have fired for a dead reckoning step even if it is not active anymore */
+    int timeout = step_timeout(&p, &br.sched, state.time, br.next_capture - now);
+    set_timeout(timeout > 0 ? timeout : 1, 0, main_p[CAPTURE_IX].fd, 0);
 }
 
-static void get_max_brightness(void) {
+static int get_max_brightness(void) {
     struct bus_args args = {"org.clightd.backlight", "/org/clightd/backlight", "org.clightd.backlight", "getmaxbrightness"};
-    bus_call(&br.max, "i", &args, "s", conf.screen_path);
+    return bus_call(&br.max, "i", &args, "s", conf.screen_path);
 }
 
-static void get_current_brightness(void) {
+static int get_current_brightness(void) {
     struct bus_args args = {"org.clightd.backlight", "/org/clightd/backlight", "org.clightd.backlight", "getbrightness"};
-    bus_call(&br.old, "i", &args, "s", conf.screen_path);
+    return bus_call(&br.old, "i", &args, "s", conf.screen_path);
 }
 
+/*
+ * Store current backlight level (to compute brightness drop), then hand our target to backlight arbiter:
+ * it will be written at the end of current main poll iteration, merged with other producers ones (eg: dimmer).
+ */
 static void set_brightness(double perc) {
-    int new_br =  br.max * perc;
+    /* max brightness could be unknown if getmaxbrightness timed out while starting */
+    if (br.max <= 0 && get_max_brightness() < 0) {
+        return;
+    }
+
     // store old brightness
-    get_current_brightness();
-    if (state.quit) {
+    if (get_current_brightness() < 0) {
         return;
     }
-    
-    if (new_br != br.old) {
-        INFO("Old brightness value: %d\n", br.old);
-        struct bus_args args = {"org.clightd.backlight", "/org/clightd/backlight", "org.clightd.backlight", "setbrightness"};
-        bus_call(&br.current, "i", &args, "si", conf.screen_path, new_br);
-        if (!state.quit) {
-            INFO("New brightness value: %d\n", br.current);
-        }
-    } else {
+    br.current = br.max * perc;
+    set_output_target(BACKLIGHT_OUTPUT, ambient_producer, perc);
+}
+
+/*
+ * Backlight arbiter output: actually write backlight level.
+ * br.old keeps last known level, as merged targets (eg: dimmer ones) are written without reading it again.
+ */
+static int apply_backlight(double perc) {
+    if (br.max <= 0 && get_max_brightness() < 0) {
+        return -1;
+    }
+
+    int new_br = br.max * perc;
+    if (new_br == br.old) {
         INFO("Brightness level was already %d.\n", new_br);
+        return 0;
     }
+
+    INFO("Old brightness value: %d\n", br.old);
+    struct bus_args args = {"org.clightd.backlight", "/org/clightd/backlight", "org.clightd.backlight", "setbrightness"};
+    int r = bus_call(&br.old, "i", &args, "si", conf.screen_path, new_br);
+    if (r == 0) {
+        STREAM("backlight", "\"new\":%d,\"max\":%d", br.old, br.max);
+        INFO("New brightness value: %d\n", br.old);
+    }
+    return r;
 }
 
 static double capture_frames_brightness(void) {
     double brightness = -1;
-    struct bus_args args = {"org.clightd.backlight", "/org/clightd/backlight", "org.clightd.backlight", "captureframes"};
-    bus_call(&brightness, "d", &args, "si", conf.dev_name, conf.num_captures);
+
+    if (frames) {
+        return local_frames_brightness();
+    }
+    struct bus_args args = {"org.clightd.backlight", "/org/clightd/backlight", "org.clightd.backlight", "captureframes", CAPTURE_TIMEOUT(conf.num_captures)};
+    /* only stream webcam region of interest, if any */
+    set_camera_roi(1);
+    set_camera_flicker();
+    /* same webcam we set up, even when clightd would pick it by itself */
+    bus_call(&brightness, "d", &args, "si", strlen(conf.dev_name) ? conf.dev_name : camera_sysname(), conf.num_captures);
+    set_camera_roi(0);
     return brightness;
 }
 
+/*
+ * Same average computed by clightd, on frames from our fake camera.
+ * Until light flicker has been detected for this source and location, same frames are searched for it.
+ * Color frames also give ambient light color temperature, from their mean color.
+ */
+static double local_frames_brightness(void) {
+    struct flicker_detector det = {0};
+    struct frame f;
+    double sum = 0, rgb[3] = {0}, frame_rgb[3];
+    int color_frames = 0;
+
+    /* same time budget clightd would get to capture these frames */
+    const time_t deadline = get_monotonic_time() + CAPTURE_TIMEOUT(conf.num_captures) / (1000 * 1000);
+    const int detect = set_source_flicker(frames, conf.frame_source);
+    for (int i = 0; i < conf.num_captures; i++) {
+        if (next_frame(frames, &f, (deadline - get_monotonic_time()) * 1000) == -1) {
+            WARN("Failed to get a frame from frame source.\n");
+            return -1;
+        }
+        sum += frame_roi_brightness(&f, get_source_roi(frames));
+        if (frame_rgb_mean(&f, frame_rgb) == 0) {
+            for (int j = 0; j < 3; j++) {
+                rgb[j] += frame_rgb[j] / conf.num_captures;
+            }
+            color_frames++;
+        }
+        if (detect) {
+            flicker_add_frame(&det, &f);
+        }
+    }
+    if (detect) {
+        end_source_flicker(frames, &det);
+    }
+    br.frames_temp = color_frames ? rgb_color_temp(rgb) : -1;
+    return sum / conf.num_captures;
+}
+
+/*
+ * Restore backlight level we found when we started.
+ */
+void restore_brightness(void) {
+    if (modules[CAPTURE_IX].inited && br.initial > 0) {
+        struct bus_args args = {"org.clightd.backlight", "/org/clightd/backlight", "org.clightd.backlight", "setbrightness"};
+        if (bus_call(&br.current, "i", &args, "si", conf.screen_path, br.initial) == 0) {
+            INFO("Backlight level restored to %d.\n", br.current);
+        }
+    }
+}
+
 void destroy_brightness(void) {
+    if (frames) {
+        close_frame_source(frames);
+    }
     if (main_p[CAPTURE_IX].fd > 0) {
         close(main_p[CAPTURE_IX].fd);
     }
@@ -1,8 +1,34 @@
 #include "../inc/bus.h"
+#include "../inc/stats.h"
+#include "../inc/signal.h"
 
+#define MAX_MATCHES 16              // signal matches added through add_match
+#define MAX_DEFERRED 32             // signals received while waiting for a method reply
+
+static uint64_t now_usec(void);
+static uint64_t get_call_timeout(const struct bus_args *a);
+static void flush_bus(void);
+static int call(sd_bus_message *m, uint64_t timeout, sd_bus_error *err, sd_bus_message **reply);
+static int call_cb(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int match_cb(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
 static void free_bus_structs(sd_bus_error *err, sd_bus_message *m, sd_bus_message *reply);
 
 static int inited;
+static int dispatching;             // whether we are inside a sd_bus_process call (ie: inside a bus callback)
+static uint64_t deadline;           // CLOCK_MONOTONIC deadline (usec) for current multi-call sequence, 0 if none
+static uint64_t shutdown_deadline;  // CLOCK_MONOTONIC deadline (usec) for whole shutdown, 0 if we're not leaving
+static int waiting;                 // whether we are waiting for a method reply inside call()
+static sd_bus_message_handler_t match_cbs[MAX_MATCHES];
+static int num_matches;
+
+/* A signal whose callback has been deferred to main poll */
+struct deferred_signal {
+    sd_bus_message *m;
+    sd_bus_message_handler_t cb;
+};
+
+static struct deferred_signal deferred[MAX_DEFERRED];
+static int num_deferred;
 
 /*
  * Open our bus
@@ -20,8 +46,9 @@ void init_bus(void) {
  * Calls a method on bus and store its result of type userptr_type in userptr.
  * Note that this is a variadic function and will correctly handle 's' and 'i' signature types.
  * Follow: https://github.com/systemd/systemd/issues/5654 (i need to propose a patch there)
+ * Returns a negative errno value on error.
  */
-void bus_call(void *userptr, const char *userptr_type, const struct bus_args *a, const char *signature, ...) {
+int bus_call(void *userptr, const char *userptr_type, const struct bus_args *a, const char *signature, ...) {
     sd_bus_error error = SD_BUS_ERROR_NULL;
     sd_bus_message *m = NULL, *reply = NULL;
 
@@ -42,6 +69,7 @@ void bus_call(void *userptr, const char *userptr_type, const struct bus_args *a,
                 s = va_arg(args, char *);
                 r = sd_bus_message_append_basic(m, 's', s);
                 if (check_err(r, &error)) {
+                    va_end(args);
                     goto finish;
                 }
                 break;
@@ -49,6 +77,7 @@ void bus_call(void *userptr, const char *userptr_type, const struct bus_args *a,
                 val = va_arg(args, int);
                 r = sd_bus_message_append_basic(m, 'i', &val);
                 if (check_err(r, &error)) {
+                    va_end(args);
                     goto finish;
                 }
                 break;
@@ -60,7 +89,7 @@ void bus_call(void *userptr, const char *userptr_type, const struct bus_args *a,
     }
 
     va_end(args);
-    r = sd_bus_call(bus, m, 0, &error, &reply);
+    r = call(m, get_call_timeout(a), &error, &reply);
     if (check_err(r, &error)) {
         goto finish;
     }
@@ -81,65 +110,326 @@ void bus_call(void *userptr, const char *userptr_type, const struct bus_args *a,
 
 finish:
     free_bus_structs(&error, m, reply);
+    return r < 0 ? r : 0;
+}
+
+/*
+ * Fire and forget a method call without arguments: no reply is expected
+ * (nor waited for), so a stuck peer cannot block us.
+ * Message is only queued; it will be written out by next bus_process or by destroy_bus.
+ */
+int bus_send(const struct bus_args *a) {
+    sd_bus_message *m = NULL;
+
+    if (get_call_timeout(a) == 0) {
+        return -ETIMEDOUT;
+    }
+
+    int r = sd_bus_message_new_method_call(bus, &m, a->service, a->path, a->interface, a->member);
+    if (!check_err(r, NULL)) {
+        r = sd_bus_message_set_expect_reply(m, 0);
+        if (!check_err(r, NULL)) {
+            COUNT(BUS_SENT_CNT);
+            r = sd_bus_send(bus, m, NULL);
+            check_err(r, NULL);
+        }
+    }
+    free_bus_structs(NULL, m, NULL);
+    return r < 0 ? r : 0;
 }
 
 /*
- * Add a match on bus on certain signal for cb callback
+ * Add a match on bus on certain signal for cb callback.
+ * cb is always called from main poll, never while another module is waiting for a reply: see match_cb.
  */
 void add_match(const struct bus_args *a, sd_bus_message_handler_t cb) {
     char match[500] = {0};
+
+    if (num_matches == MAX_MATCHES) {
+        return WARN("Too many bus matches.\n");
+    }
+    match_cbs[num_matches] = cb;
     snprintf(match, sizeof(match), "type='signal',interface='%s', member='%s', path='%s'", a->interface, a->member, a->path);
-    int r = sd_bus_add_match(bus, NULL, match, cb, NULL);
-    check_err(r, NULL);
+    int r = sd_bus_add_match(bus, NULL, match, match_cb, &match_cbs[num_matches]);
+    if (!check_err(r, NULL)) {
+        num_matches++;
+    }
+}
+
+/*
+ * Signals read while call() waits for a reply belong to someone else's sequence:
+ * running their callbacks there would nest unrelated bus calls inside caller deadline.
+ * They are queued instead, and dispatched by main poll through dispatch_bus_signals().
+ */
+static int match_cb(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    sd_bus_message_handler_t cb = *(sd_bus_message_handler_t *)userdata;
+
+    if (!waiting) {
+        return cb(m, NULL, ret_error);
+    }
+    if (num_deferred == MAX_DEFERRED) {
+        WARN("Too many pending bus signals. Dropping %s.\n", sd_bus_message_get_member(m));
+        return 0;
+    }
+    deferred[num_deferred++] = (struct deferred_signal) { sd_bus_message_ref(m), cb };
+    return 0;
+}
+
+/*
+ * Run callbacks of signals deferred by match_cb, in arrival order.
+ * Callbacks may make bus calls themselves, thus queue again.
+ */
+void dispatch_bus_signals(void) {
+    while (num_deferred > 0 && !state.quit) {
+        struct deferred_signal d = deferred[0];
+        memmove(deferred, deferred + 1, --num_deferred * sizeof(struct deferred_signal));
+        sd_bus_error error = SD_BUS_ERROR_NULL;
+        d.cb(d.m, NULL, &error);
+        free_bus_structs(&error, d.m, NULL);
+    }
 }
 
 /*
  * Set property of type "type" value to "value". It correctly handles 'u' and 's' types.
+ * Properties.Set method is called directly (instead of using sd_bus_set_property)
+ * to be able to give it a timeout.
  */
-void set_property(const struct bus_args *a, const char type, const char *value) {
+int set_property(const struct bus_args *a, const char type, const char *value) {
     sd_bus_error error = SD_BUS_ERROR_NULL;
-    int r = 0;
+    sd_bus_message *m = NULL, *reply = NULL;
+
+    int r = sd_bus_message_new_method_call(bus, &m, a->service, a->path, "org.freedesktop.DBus.Properties", "Set");
+    if (check_err(r, &error)) {
+        goto finish;
+    }
 
     switch (type) {
         case 'u':
-            r = sd_bus_set_property(bus, a->service, a->path, a->interface, a->member, &error, "u", atoi(value));
+            r = sd_bus_message_append(m, "ssv", a->interface, a->member, "u", (uint32_t)atoi(value));
             break;
         case 's':
-            r = sd_bus_set_property(bus, a->service, a->path, a->interface, a->member, &error, "s", value);
+            r = sd_bus_message_append(m, "ssv", a->interface, a->member, "s", value);
             break;
         default:
             WARN("Wrong signature in bus call: %c.\n", type);
-            break;
+            r = -EINVAL;
+            goto finish;
     }
+    if (check_err(r, &error)) {
+        goto finish;
+    }
+
+    r = call(m, get_call_timeout(a), &error, &reply);
     check_err(r, &error);
-    free_bus_structs(&error, NULL, NULL);
+
+finish:
+    free_bus_structs(&error, m, reply);
+    return r < 0 ? r : 0;
 }
 
 /*
  * Get a property of type "type" into userptr.
+ * As for set_property, Properties.Get method is called directly.
  */
-void get_property(const struct bus_args *a, const char *type, void *userptr) {
+int get_property(const struct bus_args *a, const char *type, void *userptr) {
     sd_bus_error error = SD_BUS_ERROR_NULL;
-    sd_bus_message *m = NULL;
+    sd_bus_message *m = NULL, *reply = NULL;
+
+    int r = sd_bus_message_new_method_call(bus, &m, a->service, a->path, "org.freedesktop.DBus.Properties", "Get");
+    if (check_err(r, &error)) {
+        goto finish;
+    }
+
+    r = sd_bus_message_append(m, "ss", a->interface, a->member);
+    if (check_err(r, &error)) {
+        goto finish;
+    }
 
-    int r = sd_bus_get_property(bus, a->service, a->path, a->interface, a->member, &error, &m, type);
+    r = call(m, get_call_timeout(a), &error, &reply);
     if (check_err(r, &error)) {
         goto finish;
     }
 
+    r = sd_bus_message_enter_container(reply, 'v', type);
+    if (check_err(r, NULL)) {
+        goto finish;
+    }
+
     if (!strcmp(type, "o")) {
         const char *obj = NULL;
-        r = sd_bus_message_read(m, type, &obj);
+        r = sd_bus_message_read(reply, type, &obj);
         if (r >= 0) {
             strncpy(userptr, obj, PATH_MAX);
         }
     } else {
-        r = sd_bus_message_read(m, type, userptr);
+        r = sd_bus_message_read(reply, type, userptr);
     }
     check_err(r, NULL);
 
 finish:
-    free_bus_structs(&error, m, NULL);
+    free_bus_structs(&error, m, reply);
+    return r < 0 ? r : 0;
+}
+
+/*
+ * Process pending bus messages, dispatching them to their callbacks.
+ * Modules must use this instead of sd_bus_process, so that
+ * bus calls made from inside a callback know they cannot wait asynchronously.
+ */
+int bus_process(void) {
+    dispatching = 1;
+    int r = sd_bus_process(bus, NULL);
+    dispatching = 0;
+    if (r > 0) {
+        COUNT(BUS_PROCESS_CNT);
+    }
+    return r;
+}
+
+/*
+ * Give a total time budget (usec) to a sequence of bus calls:
+ * every call of the sequence will only get remaining time as timeout
+ * (or its own timeout, if shorter), and once budget is exhausted
+ * any following call will immediately fail with -ETIMEDOUT.
+ * If a deadline is already set, the earlier one is kept.
+ */
+void set_bus_deadline(uint64_t budget) {
+    uint64_t d = now_usec() + budget;
+    if (!deadline || d < deadline) {
+        deadline = d;
+    }
+}
+
+void reset_bus_deadline(void) {
+    deadline = 0;
+}
+
+/*
+ * Give whole shutdown a time budget (usec): unlike set_bus_deadline,
+ * it is never reset, and it bounds every following bus call and bus flush.
+ */
+void set_shutdown_deadline(uint64_t budget) {
+    shutdown_deadline = now_usec() + budget;
+}
+
+int shutdown_deadline_expired(void) {
+    return shutdown_deadline && now_usec() >= shutdown_deadline;
+}
+
+static uint64_t now_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 * 1000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Returns timeout for a call, given its bus_args and current deadline.
+ * 0 means deadline already expired.
+ */
+static uint64_t get_call_timeout(const struct bus_args *a) {
+    uint64_t timeout = a->timeout ? a->timeout : BUS_TIMEOUT;
+    uint64_t d = deadline;
+
+    if (shutdown_deadline && (!d || shutdown_deadline < d)) {
+        d = shutdown_deadline;
+    }
+    if (d) {
+        uint64_t now = now_usec();
+        if (now >= d) {
+            WARN("Deadline expired. Skipping %s call.\n", a->member);
+            return 0;
+        }
+        if (d - now < timeout) {
+            timeout = d - now;
+        }
+    }
+    return timeout;
+}
+
+/*
+ * Sends m and waits for its reply for at most timeout usec.
+ * While waiting, signalfd is listened on too: if a SIGINT or SIGTERM is pending,
+ * pending call gets cancelled and -ECANCELED is returned,
+ * so that we never wait on a stuck peer while leaving. Signals are not consumed here:
+ * main poll will handle them. Bus signals received meanwhile are deferred (see match_cb).
+ * If we are inside a bus callback, sd_bus_process cannot be called again:
+ * in that case, just do a sync call (still bounded by timeout).
+ */
+static int call(sd_bus_message *m, uint64_t timeout, sd_bus_error *err, sd_bus_message **reply) {
+    if (timeout == 0) {
+        return -ETIMEDOUT;
+    }
+
+    COUNT(BUS_SENT_CNT);
+    if (dispatching) {
+        return sd_bus_call(bus, m, timeout, err, reply);
+    }
+
+    sd_bus_slot *slot = NULL;
+    int r = sd_bus_call_async(bus, &slot, m, call_cb, reply, timeout);
+    if (r < 0) {
+        return r;
+    }
+
+    const uint64_t end = now_usec() + timeout;
+    int signal_fd = modules[SIGNAL_IX].inited ? main_p[SIGNAL_IX].fd : -1;
+    waiting = 1;
+    while (!*reply) {
+        r = bus_process();
+        if (r < 0) {
+            break;
+        }
+        if (r > 0) {
+            continue;
+        }
+
+        uint64_t now = now_usec();
+        if (now >= end) {
+            r = -ETIMEDOUT;
+            break;
+        }
+
+        struct pollfd p[2] = {
+            { .fd = sd_bus_get_fd(bus), .events = sd_bus_get_events(bus) },
+            { .fd = signal_fd, .events = POLLIN },
+        };
+        COUNT(POLL_CNT);
+        r = poll(p, 2, (end - now) / 1000 + 1);
+        if (r == -1 && errno != EINTR) {
+            r = -errno;
+            break;
+        }
+        if (p[1].revents & POLLIN) {
+            if (quit_signal_pending()) {
+                r = -ECANCELED;
+                break;
+            }
+            /* other signals stay queued for main poll: stop listening on signalfd, it would keep waking us */
+            signal_fd = -1;
+        }
+    }
+    waiting = 0;
+    /* If call is still pending, this cancels it */
+    sd_bus_slot_unref(slot);
+
+    if (*reply) {
+        r = 0;
+        if (sd_bus_message_is_method_error(*reply, NULL)) {
+            r = sd_bus_error_copy(err, sd_bus_message_get_error(*reply));
+        }
+    }
+    return r;
+}
+
+/*
+ * Async call reply handler: just store a reference to reply message (or error).
+ */
+static int call_cb(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    sd_bus_message **reply = (sd_bus_message **)userdata;
+
+    *reply = sd_bus_message_ref(m);
+    return 0;
 }
 
 /*
@@ -161,26 +451,50 @@ static void free_bus_structs(sd_bus_error *err, sd_bus_message *m, sd_bus_messag
 
 /*
  * Check any error. Do not leave for EBUSY errors.
+ * Do not leave for timed out or cancelled calls either:
+ * a stuck peer must not kill us, and calls get cancelled only when we are already leaving.
  */
 int check_err(int r, sd_bus_error *err) {
     if (r < 0) {
-        /* Don't leave for ebusy errors */
-        if (r == -EBUSY) {
-            WARN("%s\n", err->message ? err->message : strerror(-r));
+        const char *msg = err && err->message ? err->message : strerror(-r);
+        if (r == -EBUSY || r == -ETIMEDOUT || r == -ECANCELED) {
+            WARN("%s\n", msg);
         } else {
-            ERROR("%s\n", err->message ? err->message : strerror(-r));
+            ERROR("%s\n", msg);
         }
     }
     return r < 0;
 }
 
 /*
- * Close bus.
+ * Write out queued messages (eg: fire and forget calls made while leaving),
+ * without waiting past shutdown deadline.
+ */
+static void flush_bus(void) {
+    while (!shutdown_deadline_expired() && (sd_bus_get_events(bus) & POLLOUT)) {
+        if (sd_bus_process(bus, NULL) > 0) {
+            continue;
+        }
+        int timeout = shutdown_deadline ? (shutdown_deadline - now_usec()) / 1000 + 1 : -1;
+        struct pollfd p = { .fd = sd_bus_get_fd(bus), .events = POLLOUT };
+        if (poll(&p, 1, timeout) <= 0) {
+            break;
+        }
+    }
+}
+
+/*
+ * Close bus, after flushing it (bounded by shutdown deadline).
  */
 void destroy_bus(void) {
     if (inited) {
+        for (int i = 0; i < num_deferred; i++) {
+            sd_bus_message_unref(deferred[i].m);
+        }
         if (bus) {
-            sd_bus_flush_close_unref(bus);
+            flush_bus();
+            sd_bus_close(bus);
+            sd_bus_unref(bus);
         }
         INFO("Bus destroyed.\n");
     }
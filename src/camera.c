@@ -0,0 +1,274 @@
+#include "../inc/camera.h"
+#include <linux/videodev2.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#define V4L2_CLASS_DIR "/sys/class/video4linux"
+
+static int find_capture_device(char *name);
+static int open_camera(void);
+static int get_ctrl(int fd, uint32_t id, int *value);
+static int get_crop(int fd, struct v4l2_rect *r);
+
+static const double full_roi[4] = { 0.0, 0.0, 1.0, 1.0 };
+static int crop_unsupported;        // whether webcam driver refused a crop (or did not keep it): do not try again
+static struct v4l2_rect crop;       // crop rectangle applied by set_camera_roi(1)
+static char sysname[NAME_MAX + 1];  // sysname of webcam used for captures, once known
+static int camera_fd = -1;          // webcam fd, kept open until close_camera()
+
+/*
+ * Lowest numbered video4linux device that can capture frames (metadata nodes can't),
+ * the same clightd picks when it is not given a device. Returns -1 if none is found.
+ */
+static int find_capture_device(char *name) {
+    DIR *d = opendir(V4L2_CLASS_DIR);
+    struct dirent *entry;
+    int best = -1;
+
+    if (!d) {
+        return -1;
+    }
+    while ((entry = readdir(d))) {
+        char path[PATH_MAX + 1];
+        struct v4l2_capability cap = {0};
+        int num;
+
+        if (sscanf(entry->d_name, "video%d", &num) != 1 || (best != -1 && num >= best)) {
+            continue;
+        }
+        snprintf(path, PATH_MAX, "/dev/%s", entry->d_name);
+        int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (fd == -1) {
+            continue;
+        }
+        if (ioctl(fd, VIDIOC_QUERYCAP, &cap) == 0
+            && ((cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps : cap.capabilities) & V4L2_CAP_VIDEO_CAPTURE) {
+            best = num;
+        }
+        close(fd);
+    }
+    closedir(d);
+
+    if (best == -1) {
+        return -1;
+    }
+    snprintf(name, NAME_MAX, "video%d", best);
+    return 0;
+}
+
+/*
+ * Frames are grabbed by clightd: we only open webcam device to read and write its controls,
+ * without streaming. conf.dev_name may be a sysname (eg: video0) or a path.
+ * Device is opened once for a whole capture: it is closed by close_camera() once capture is over.
+ */
+static int open_camera(void) {
+    char path[PATH_MAX + 1];
+
+    if (camera_fd != -1) {
+        return camera_fd;
+    }
+    if (conf.dev_name[0] == '/') {
+        strncpy(path, conf.dev_name, PATH_MAX);
+    } else {
+        snprintf(path, PATH_MAX, "/dev/%s", camera_sysname());
+    }
+    camera_fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    return camera_fd;
+}
+
+void close_camera(void) {
+    if (camera_fd != -1) {
+        close(camera_fd);
+        camera_fd = -1;
+    }
+}
+
+static int get_ctrl(int fd, uint32_t id, int *value) {
+    struct v4l2_control ctrl = { .id = id };
+
+    if (ioctl(fd, VIDIOC_G_CTRL, &ctrl) == -1) {
+        return -1;
+    }
+    *value = ctrl.value;
+    return 0;
+}
+
+/*
+ * Read white balance temperature (in Kelvin) chosen by webcam auto white balance,
+ * ie: an estimate of ambient light correlated color temperature.
+ * To be called right after a capture: camera is still powered on and its AWB has just converged
+ * on the same frames used for brightness, so no extra capture is needed.
+ * Most drivers (eg: uvcvideo) mark white balance temperature inactive while AWB is on:
+ * it then only holds last manual value, not AWB one.
+ * Returns -1 if not available (eg: no AWB, no white balance temperature control, or an inactive one).
+ */
+int get_camera_color_temp(void) {
+    struct v4l2_query_ext_ctrl q = { .id = V4L2_CID_WHITE_BALANCE_TEMPERATURE };
+    int awb = 0, temp = -1;
+
+    int fd = open_camera();
+    if (fd == -1) {
+        return -1;
+    }
+    if (get_ctrl(fd, V4L2_CID_AUTO_WHITE_BALANCE, &awb) == -1 || !awb
+        || ioctl(fd, VIDIOC_QUERY_EXT_CTRL, &q) == -1 || (q.flags & (V4L2_CTRL_FLAG_INACTIVE | V4L2_CTRL_FLAG_DISABLED))
+        || get_ctrl(fd, V4L2_CID_WHITE_BALANCE_TEMPERATURE, &temp) == -1) {
+        temp = -1;
+    }
+    return temp;
+}
+
+/*
+ * Sysname (eg: video0) of webcam used for captures, as used for per device ROIs and cache keys:
+ * conf.dev_name one, or first capture device if it is not set (this device is then passed to clightd too,
+ * so that we never set up a webcam while clightd captures from another one).
+ * If no capture device is found, "video0" is returned, and a new lookup is done next time.
+ */
+const char *camera_sysname(void) {
+    if (!strlen(sysname)) {
+        if (strlen(conf.dev_name)) {
+            const char *name = strrchr(conf.dev_name, '/');
+            strncpy(sysname, name ? name + 1 : conf.dev_name, NAME_MAX);
+        } else if (find_capture_device(sysname) == -1) {
+            return "video0";
+        } else {
+            INFO("Using webcam %s.\n", sysname);
+        }
+    }
+    return sysname;
+}
+
+/*
+ * Ambient region of interest for device: cmdline one, then device specific one,
+ * then "default" one from config file; whole view if none is set.
+ */
+const double *get_roi(const char *device) {
+    const double *roi = full_roi;
+
+    if (conf.roi[2] > 0) {
+        return conf.roi;
+    }
+    for (int i = 0; i < conf.num_rois; i++) {
+        if (!strcmp(conf.rois[i].device, device)) {
+            return conf.rois[i].roi;
+        }
+        if (!strcmp(conf.rois[i].device, "default")) {
+            roi = conf.rois[i].roi;
+        }
+    }
+    return roi;
+}
+
+int is_full_roi(const double *roi) {
+    return !memcmp(roi, full_roi, sizeof(full_roi));
+}
+
+/*
+ * Crop webcam view to roi through V4L2 selection API, so that only ROI pixels get streamed.
+ * Compose rectangle is shrunk to cropped size, so that driver does not upscale it back.
+ * A NULL roi restores default crop. Returns -1 if driver does not support cropping.
+ */
+int set_camera_crop(int fd, const double *roi) {
+    struct v4l2_selection sel = { .type = V4L2_BUF_TYPE_VIDEO_CAPTURE, .target = V4L2_SEL_TGT_CROP_BOUNDS };
+
+    if (!roi) {
+        sel.target = V4L2_SEL_TGT_CROP_DEFAULT;
+        if (ioctl(fd, VIDIOC_G_SELECTION, &sel) == -1) {
+            return -1;
+        }
+    } else {
+        if (ioctl(fd, VIDIOC_G_SELECTION, &sel) == -1) {
+            return -1;
+        }
+        const struct v4l2_rect bounds = sel.r;
+        sel.r.left = bounds.left + lround(roi[0] * bounds.width);
+        sel.r.top = bounds.top + lround(roi[1] * bounds.height);
+        sel.r.width = lround(roi[2] * bounds.width);
+        sel.r.height = lround(roi[3] * bounds.height);
+    }
+    sel.target = V4L2_SEL_TGT_CROP;
+    if (ioctl(fd, VIDIOC_S_SELECTION, &sel) == -1) {
+        return -1;
+    }
+
+    sel.target = V4L2_SEL_TGT_COMPOSE;
+    sel.r.left = sel.r.top = 0;
+    ioctl(fd, VIDIOC_S_SELECTION, &sel);
+    return 0;
+}
+
+static int get_crop(int fd, struct v4l2_rect *r) {
+    struct v4l2_selection sel = { .type = V4L2_BUF_TYPE_VIDEO_CAPTURE, .target = V4L2_SEL_TGT_CROP };
+
+    if (ioctl(fd, VIDIOC_G_SELECTION, &sel) == -1) {
+        return -1;
+    }
+    *r = sel.r;
+    return 0;
+}
+
+/*
+ * Crop (or restore) webcam used by clightd for captures, around each capture:
+ * crop is device state, so other applications would see it too if left there.
+ * Crop is set before clightd sets its format, that may reset it (and many drivers, eg: uvcvideo,
+ * do not support cropping at all): once capture is over, check crop is still the applied one,
+ * otherwise warn and stop cropping, as whole view was captured anyway.
+ * Does nothing if no ROI is set for webcam.
+ */
+void set_camera_roi(int enable) {
+    const double *roi = get_roi(camera_sysname());
+
+    if (crop_unsupported || is_full_roi(roi)) {
+        return;
+    }
+
+    int fd = open_camera();
+    if (fd == -1) {
+        return;
+    }
+    if (enable) {
+        if (set_camera_crop(fd, roi) == -1 || get_crop(fd, &crop) == -1) {
+            crop_unsupported = 1;
+            WARN("Webcam does not support cropping: whole view will be used.\n");
+        }
+    } else {
+        struct v4l2_rect cur;
+        if (get_crop(fd, &cur) == -1 || memcmp(&cur, &crop, sizeof(cur))) {
+            crop_unsupported = 1;
+            WARN("Webcam crop was reset during capture: whole view will be used.\n");
+        }
+        set_camera_crop(fd, NULL);
+    }
+}
+
+/*
+ * Set anti flicker (V4L2_CID_POWER_LINE_FREQUENCY) to mains frequency hz (50 or 60):
+ * driver then keeps exposure time a multiple of light flicker period, so that rolling shutter bands disappear.
+ * Control is only written if it changed. Returns -1 if driver does not expose it.
+ */
+int set_power_line_frequency(int fd, int hz) {
+    const int value = hz == 60 ? V4L2_CID_POWER_LINE_FREQUENCY_60HZ : V4L2_CID_POWER_LINE_FREQUENCY_50HZ;
+    int old;
+
+    if (get_ctrl(fd, V4L2_CID_POWER_LINE_FREQUENCY, &old) == -1) {
+        return -1;
+    }
+    if (old != value) {
+        struct v4l2_control ctrl = { .id = V4L2_CID_POWER_LINE_FREQUENCY, .value = value };
+        return ioctl(fd, VIDIOC_S_CTRL, &ctrl);
+    }
+    return 0;
+}
+
+/*
+ * Set anti flicker of webcam used by clightd for captures.
+ * Unlike crop, it is left there: it is right for any application using webcam in this place.
+ */
+int set_camera_power_line(int hz) {
+    int fd = open_camera();
+    if (fd == -1) {
+        return -1;
+    }
+    return set_power_line_frequency(fd, hz);
+}
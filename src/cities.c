@@ -0,0 +1,110 @@
+#include "../inc/cities.h"
+#include <ctype.h>
+
+/*
+ * Cities table is generated at compile time from a GeoNames dump
+ * (Extra/cities.txt by default, eg: cities15000.txt through "make CITIES=..."),
+ * already sorted by lowercase ascii name (C locale) and, for same name, by population.
+ * Being a const array, it lives in read-only data section: it is mmapped
+ * together with our binary, and no parsing is needed at runtime.
+ */
+struct city {
+    const char *name;       // lowercase ascii name
+    const char cc[3];       // ISO country code
+    double lat;
+    double lon;
+    int population;
+};
+
+static const struct city cities[] = {
+#include "../inc/cities_db.h"
+};
+
+static int lower_bound(const char *key);
+
+/*
+ * Binary search first city whose name is >= key.
+ */
+static int lower_bound(const char *key) {
+    int lo = 0, hi = sizeof(cities) / sizeof(cities[0]);
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strcmp(cities[mid].name, key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * Query is "name" or "name,CC" (eg: "rome" or "san jose,US"), case insensitive.
+ * Exact name matches are preferred, otherwise query is used as a prefix;
+ * among candidates, most populated city wins.
+ * Returns 0 and fills lat/lon if a city is found, -1 otherwise.
+ */
+int find_city(const char *query, double *lat, double *lon) {
+    char key[64] = {0};
+    char cc[3] = {0};
+    const struct city *best = NULL;
+    int best_exact = 0;
+
+    int len;
+    for (len = 0; query[len] && query[len] != ',' && len < (int)sizeof(key) - 1; len++) {
+        key[len] = tolower(query[len]);
+    }
+    if (query[len] == ',') {
+        for (int i = 0; i < 2 && query[len + 1 + i]; i++) {
+            cc[i] = toupper(query[len + 1 + i]);
+        }
+    }
+    if (len == 0) {
+        return -1;
+    }
+
+    const int size = sizeof(cities) / sizeof(cities[0]);
+    for (int i = lower_bound(key); i < size && !strncmp(cities[i].name, key, len); i++) {
+        if (strlen(cc) && strcmp(cities[i].cc, cc)) {
+            continue;
+        }
+        int exact = cities[i].name[len] == '\0';
+        if (!best || exact > best_exact || (exact == best_exact && cities[i].population > best->population)) {
+            best = &cities[i];
+            best_exact = exact;
+        }
+    }
+
+    if (!best) {
+        return -1;
+    }
+    INFO("Using location of %s (%s): %.2lf, %.2lf.\n", best->name, best->cc, best->lat, best->lon);
+    *lat = best->lat;
+    *lon = best->lon;
+    return 0;
+}
+
+/*
+ * Country code of nearest city to lat/lon, or NULL if cities table is empty.
+ * Distances are compared on an equirectangular projection: precise enough to pick nearest city.
+ */
+const char *nearest_city_country(double lat, double lon) {
+    const struct city *best = NULL;
+    double best_dist = 0;
+
+    for (int i = 0; i < (int)(sizeof(cities) / sizeof(cities[0])); i++) {
+        double dlon = fabs(cities[i].lon - lon);
+        if (dlon > 180) {
+            dlon = 360 - dlon;
+        }
+        const double x = dlon * cos(M_PI * (lat + cities[i].lat) / 360);
+        const double y = cities[i].lat - lat;
+        const double dist = x * x + y * y;
+        if (!best || dist < best_dist) {
+            best = &cities[i];
+            best_dist = dist;
+        }
+    }
+    return best ? best->cc : NULL;
+}
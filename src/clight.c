@@ -29,33 +29,55 @@
 #include "../inc/dpms.h"
 #include "../inc/opts.h"
 #include "../inc/lock.h"
+#include "../inc/event.h"
+#include "../inc/trace.h"
+#include "../inc/tuner.h"
+#include "../inc/evaluator.h"
+#include "../inc/stats.h"
+#include "../inc/stream.h"
+#include "../inc/pressure.h"
+#include "../inc/energy.h"
+#include "../inc/dimmer.h"
+#include "../inc/upower.h"
+#include "../inc/inhibit.h"
+#include "../inc/arbiter.h"
+#include "../inc/hooks.h"
 
 static void init(int argc, char *argv[]);
-static void destroy(void);
+static int destroy(void);
 static void main_poll(void);
 
 /*
  * pointers to init modules functions;
  */
 static void (*const init_m[MODULES_NUM])(void) = {
-    init_brightness, init_location, init_gamma, init_signal, init_dpms
+    init_brightness, init_location, init_gamma, init_signal, init_dpms, init_stream, init_pressure, init_energy, init_dimmer, init_upower, init_inhibit, init_hooks
 };
 
 int main(int argc, char *argv[]) {
     init(argc, argv);
     main_poll();
-    destroy();
-    return 0;
+    return destroy();
 }
 
 /*
  * First of all loads optiosn from both global and local config file,
  * and from cmdline options.
+ * If we've been asked to tune parameters or to evaluate estimators, just do it and leave.
  * If we're not in single_capture_mode, it gains lock and opens log.
  * Then checks conf and init needed modules.
  */
 static void init(int argc, char *argv[]) {
     init_opts(argc, argv);
+    if (strlen(conf.tune_file) && !state.quit) {
+        check_conf();
+        tune();
+        state.quit = 1;
+    }
+    if (strlen(conf.evaluate_dir) && !state.quit) {
+        evaluate();
+        state.quit = 1;
+    }
     if (!conf.single_capture_mode && !state.quit) {
         gain_lck();
         if (!state.quit) { 
@@ -67,32 +89,83 @@ static void init(int argc, char *argv[]) {
         return;
     }
     check_conf();
+    if (!conf.single_capture_mode) {
+        fork_hooks_helper();
+    }
     init_bus();
     // do not init every module if we're doing a single capture
     const int limit = conf.single_capture_mode ? 1 : MODULES_NUM;
     for (int i = 0; i < limit && !state.quit; i++) {
         init_m[i]();
     }
+    if (!conf.single_capture_mode && !state.quit) {
+        init_trace();
+        init_stats();
+    }
 }
 
 /**
- * Free every used resource
+ * Free every used resource.
+ * Whole shutdown shares a single time budget, so that a stuck peer cannot delay our exit:
+ * screen backlight and temperature are restored first (if requested),
+ * then dimmer and dpms always restore X state (undimmed backlight, screensaver and dpms timeouts);
+ * other modules are destroyed until budget is exhausted, as remaining cleanup is best-effort.
+ * Log and lock are always released.
+ * Returns exit status: failure if syscalls budget (see stats.c) was requested and exceeded.
  */
-static void destroy(void) {
+static int destroy(void) {
+    int ret = EXIT_SUCCESS;
+
+    if (!conf.single_capture_mode && modules[CAPTURE_IX].inited) {
+        log_stats();
+        if (strlen(conf.budget_file) && check_budget() == -1) {
+            ret = EXIT_FAILURE;
+        }
+    }
+    set_shutdown_deadline(SHUTDOWN_TIMEOUT);
+    if (conf.restore_on_exit) {
+        restore_gamma();
+        restore_brightness();
+    }
+    /* Undim backlight and give back screen/dpms timeouts to X whatever budget is left */
+    destroy_module(DIMMER_IX);
+    destroy_module(DPMS_IX);
     for (int i = 0; i < MODULES_NUM; i++) {
+        if (i == DIMMER_IX || i == DPMS_IX) {
+            continue;
+        }
+        if (shutdown_deadline_expired()) {
+            WARN("Shutdown deadline expired. Skipping remaining cleanup.\n");
+            break;
+        }
         destroy_module(i);
     }
+    destroy_trace();
     destroy_bus();
     close_log();
     destroy_lck();
+    return ret;
 }
 
 /*
- * Listens on all fds and calls correct callback
+ * Listens on all fds and calls correct callback.
+ * Before each poll, dispatches internal events published by modules during last iteration;
+ * if some of them are still pending, poll won't block.
+ * Then, outputs targets set during this iteration get merged and applied.
  */
 static void main_poll(void) {
     while (!state.quit) {
-        int r = poll(main_p, MODULES_NUM, -1);
+        /* bus signals received while a module was waiting for a reply */
+        dispatch_bus_signals();
+        int timeout = dispatch_events() ? 0 : -1;
+        if (state.quit) {
+            return;
+        }
+        /* at most one write per output for each iteration */
+        flush_outputs();
+
+        COUNT(POLL_CNT);
+        int r = poll(main_p, MODULES_NUM, timeout);
         if (r == -1) {
             if (errno == EINTR) {
                 continue;
@@ -100,11 +173,11 @@ static void main_poll(void) {
             state.quit = 1;
             return;
         }
+        COUNT(WAKEUPS_CNT);
 
         for (int i = 0; i < MODULES_NUM && r > 0; i++) {
             /*
              * it should never happen that no cb is registered for a polled module.
-             * dpms_module does not register an fd to be listened on poll.
              */
             if ((main_p[i].revents & POLLIN) && (modules[i].poll_cb)) {
                 modules[i].poll_cb();
@@ -2,6 +2,9 @@
 #include <libconfig.h>
 
 static void init_config_file(enum CONFIG file);
+static void read_dpms_timeouts(config_t *cfg, const char *name, int *timeouts);
+static void read_hooks(config_t *cfg);
+static void read_rois(config_t *cfg);
 
 static char config_file[PATH_MAX + 1];
 
@@ -101,7 +104,7 @@ static void init_config_file(enum CONFIG file) {
 
 void read_config(enum CONFIG file) {
     config_t cfg;
-    const char *videodev, *screendev, *sunrise, *sunset;
+    const char *videodev, *screendev, *sunrise, *sunset, *trace, *city, *frame_source;
     
     init_config_file(file);
     if (access(config_file, F_OK) == -1) {
@@ -120,6 +123,25 @@ void read_config(enum CONFIG file) {
         config_lookup_int(&cfg, "no_gamma", &conf.no_gamma);
         config_lookup_float(&cfg, "latitude", &conf.lat);
         config_lookup_float(&cfg, "longitude", &conf.lon);
+        config_lookup_float(&cfg, "drop_limit", &conf.drop_limit);
+        config_lookup_int(&cfg, "pressure_threshold", &conf.pressure_threshold);
+        config_lookup_int(&cfg, "max_pressure_deferral", &conf.max_pressure_deferral);
+        config_lookup_int(&cfg, "no_pressure", &conf.no_pressure);
+        config_lookup_int(&cfg, "no_dead_reckoning", &conf.no_dead_reckoning);
+        config_lookup_int(&cfg, "restore_on_exit", &conf.restore_on_exit);
+        config_lookup_int(&cfg, "no_dimmer", &conf.no_dimmer);
+        config_lookup_int(&cfg, "dimmer_timeout", &conf.dimmer_timeout);
+        config_lookup_float(&cfg, "dimmer_pct", &conf.dimmer_pct);
+        config_lookup_int(&cfg, "capture_freshness", &conf.capture_freshness);
+        config_lookup_float(&cfg, "ambient_gamma_weight", &conf.ambient_gamma_weight);
+        config_lookup_int(&cfg, "no_inhibit", &conf.no_inhibit);
+        config_lookup_int(&cfg, "no_flicker", &conf.no_flicker);
+        config_lookup_int(&cfg, "manage_dpms", &conf.manage_dpms);
+        read_dpms_timeouts(&cfg, "dpms_timeouts", conf.dpms_timeouts[ON_AC]);
+        read_dpms_timeouts(&cfg, "batt_dpms_timeouts", conf.dpms_timeouts[ON_BATTERY]);
+        config_lookup_int(&cfg, "hooks_concurrency", &conf.hooks_concurrency);
+        read_hooks(&cfg);
+        read_rois(&cfg);
         
         if (config_lookup_string(&cfg, "video_devname", &videodev) == CONFIG_TRUE) {
             strncpy(conf.dev_name, videodev, sizeof(conf.dev_name) - 1);
@@ -133,6 +155,15 @@ void read_config(enum CONFIG file) {
         if (config_lookup_string(&cfg, "sunset", &sunset) == CONFIG_TRUE) {
             strncpy(conf.events[SUNSET], sunset, sizeof(conf.events[SUNSET]) - 1);
         }
+        if (config_lookup_string(&cfg, "city", &city) == CONFIG_TRUE) {
+            strncpy(conf.city, city, sizeof(conf.city) - 1);
+        }
+        if (config_lookup_string(&cfg, "frame_source", &frame_source) == CONFIG_TRUE) {
+            strncpy(conf.frame_source, frame_source, sizeof(conf.frame_source) - 1);
+        }
+        if (config_lookup_string(&cfg, "trace_file", &trace) == CONFIG_TRUE) {
+            strncpy(conf.trace_file, trace, sizeof(conf.trace_file) - 1);
+        }
 
     } else {
         WARN("Config file: %s at line %d.\n",
@@ -141,3 +172,117 @@ void read_config(enum CONFIG file) {
     }
     config_destroy(&cfg);
 }
+
+/*
+ * Read a [day, night, event] dpms timeouts array.
+ */
+static void read_dpms_timeouts(config_t *cfg, const char *name, int *timeouts) {
+    config_setting_t *setting = config_lookup(cfg, name);
+
+    if (setting) {
+        if (config_setting_length(setting) == SIZE_STATES - 1) {
+            for (int i = DAY; i < SIZE_STATES; i++) {
+                timeouts[i] = config_setting_get_int_elem(setting, i - DAY);
+            }
+        } else {
+            WARN("Wrong %s length.\n", name);
+        }
+    }
+}
+
+/*
+ * Read hooks list: each hook is a group like
+ * { event = "state"; command = "notify-send clight $CLIGHT_VALUE"; timeout = 10; }
+ * where timeout is optional.
+ */
+static void read_hooks(config_t *cfg) {
+    config_setting_t *setting = config_lookup(cfg, "hooks");
+    if (!setting) {
+        return;
+    }
+
+    int len = config_setting_length(setting);
+    /* hooks from both global and local config file are used */
+    if (conf.num_hooks + len > MAX_HOOKS) {
+        WARN("Too many hooks: only first %d will be used.\n", MAX_HOOKS);
+        len = MAX_HOOKS - conf.num_hooks;
+    }
+    for (int i = 0; i < len; i++) {
+        config_setting_t *h = config_setting_get_elem(setting, i);
+        const char *event, *command;
+        struct hook_conf *hook = &conf.hooks[conf.num_hooks];
+
+        if (config_setting_lookup_string(h, "event", &event) != CONFIG_TRUE
+            || config_setting_lookup_string(h, "command", &command) != CONFIG_TRUE) {
+            WARN("Hook %d needs both event and command.\n", i);
+            continue;
+        }
+        strncpy(hook->event, event, sizeof(hook->event) - 1);
+        strncpy(hook->command, command, sizeof(hook->command) - 1);
+        hook->timeout = HOOK_TIMEOUT;
+        config_setting_lookup_int(h, "timeout", &hook->timeout);
+        conf.num_hooks++;
+    }
+}
+
+/*
+ * Read per device regions of interest, eg:
+ * rois = { default = [ 0.0, 0.0, 1.0, 0.5 ]; video2 = [ 0.25, 0.0, 0.5, 0.5 ]; };
+ */
+static void read_rois(config_t *cfg) {
+    config_setting_t *setting = config_lookup(cfg, "rois");
+    if (!setting) {
+        return;
+    }
+
+    for (int i = 0; i < config_setting_length(setting); i++) {
+        config_setting_t *r = config_setting_get_elem(setting, i);
+        const char *device = config_setting_name(r);
+        struct roi_conf *roi = NULL;
+
+        /* local config file overrides global one */
+        for (int j = 0; j < conf.num_rois && !roi; j++) {
+            if (!strcmp(conf.rois[j].device, device)) {
+                roi = &conf.rois[j];
+            }
+        }
+        if (!roi) {
+            if (conf.num_rois == MAX_ROIS) {
+                WARN("Too many rois: only first %d will be used.\n", MAX_ROIS);
+                break;
+            }
+            roi = &conf.rois[conf.num_rois++];
+            strncpy(roi->device, device, sizeof(roi->device) - 1);
+        }
+        if (config_setting_length(r) != 4) {
+            WARN("Wrong %s roi length.\n", device);
+            memcpy(roi->roi, (double[4]){ 0.0, 0.0, 1.0, 1.0 }, sizeof(roi->roi));
+            continue;
+        }
+        for (int j = 0; j < 4; j++) {
+            roi->roi[j] = config_setting_get_float_elem(r, j);
+        }
+    }
+}
+
+/*
+ * Read per day budgets file: each of names is an optional int setting.
+ * Missing budgets are set to -1 (ie: unchecked).
+ */
+int read_budget(const char *path, const char *const names[], int num, double *budget) {
+    config_t cfg;
+    int ret = 0;
+
+    config_init(&cfg);
+    if (config_read_file(&cfg, path) == CONFIG_TRUE) {
+        for (int i = 0; i < num; i++) {
+            int val;
+            budget[i] = config_lookup_int(&cfg, names[i], &val) == CONFIG_TRUE ? val : -1;
+        }
+    } else {
+        WARN("Budget file %s: %s at line %d.\n", path, config_error_text(&cfg), config_error_line(&cfg));
+        ret = -1;
+    }
+    config_destroy(&cfg);
+    return ret;
+}
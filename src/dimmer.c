@@ -0,0 +1,295 @@
+#include "../inc/dimmer.h"
+#include "../inc/event.h"
+#include "../inc/stream.h"
+#include "../inc/inhibit.h"
+#include "../inc/arbiter.h"
+#include "../inc/stats.h"
+#include "../inc/coroutine.h"
+#include <xcb/sync.h>
+#include <sys/epoll.h>
+
+#define DIMMER_STEP 0.05                        // backlight change for each smooth transition step
+#define DIMMER_STEP_TIMEOUT 30 * 1000 * 1000    // nsec between smooth transition steps
+
+enum alarms { IDLE_ALARM, ACTIVITY_ALARM, SIZE_ALARMS };
+
+static int init_idle_counter(void);
+static int init_dimmer_fd(void);
+static void set_alarm(enum alarms a, int64_t value, uint32_t test);
+static void dimmer_cb(void);
+static void handle_alarms(void);
+static void inhibit_changed_cb(const struct event *ev);
+static void dim(int64_t idle);
+static void undim(void);
+static void start_transition(void);
+static int transition_co(struct coroutine *co);
+
+static xcb_connection_t *connection;
+static xcb_sync_counter_t idle_counter;
+static xcb_sync_alarm_t alarms[SIZE_ALARMS];
+static uint8_t first_event;                     // first event code of sync extension
+static int timer_fd = -1;                       // smooth transitions timer
+static int dimmed;                              // whether user is idle
+static int producer;                            // our backlight arbiter producer id
+static double level;                            // our current backlight target
+static double target;                           // where smooth transition is heading to
+static double saved;                            // backlight level before dimming
+static struct coroutine transition;             // smooth transition towards target
+
+/*
+ * XSync IDLETIME system counter holds ms since last user input.
+ * Two alarms are set on it: IDLE_ALARM fires when it reaches conf.dimmer_timeout,
+ * ACTIVITY_ALARM (only set while dimmed) fires as soon as it goes back to 0.
+ * Thus, X wakes us up only when user becomes idle and when user input resumes, without any polling.
+ * Dimmer has its own xcb connection: replies read on a shared one (eg: by dpms module)
+ * could pull our alarm events into xcb queue, and its fd would not wake us up anymore.
+ * Its fd and smooth transitions timer are added to an epoll fd, that is the one polled by main poll.
+ */
+void init_dimmer(void) {
+    int fd = DONT_POLL_W_ERR;
+
+    if (conf.no_dimmer) {
+        return;
+    }
+
+    connection = xcb_connect(NULL, NULL);
+    if (xcb_connection_has_error(connection)) {
+        WARN("No X connection available.\n");
+    } else if (init_idle_counter() == -1) {
+        WARN("XSync IDLETIME counter not available.\n");
+    } else {
+        fd = init_dimmer_fd();
+    }
+
+    /* dimmer is not needed by clight to work: do not leave on error */
+    if (fd != DONT_POLL_W_ERR) {
+        set_alarm(IDLE_ALARM, (int64_t)conf.dimmer_timeout * 1000, XCB_SYNC_TESTTYPE_POSITIVE_COMPARISON);
+        subscribe_event(INHIBIT_CHANGED, inhibit_changed_cb);
+        producer = add_producer(BACKLIGHT_OUTPUT, "dimmer", DIMMER_PRIORITY, COMBINE_MIN);
+    }
+    init_module(fd, DIMMER_IX, dimmer_cb, destroy_dimmer);
+}
+
+static int init_idle_counter(void) {
+    const xcb_query_extension_reply_t *ext = xcb_get_extension_data(connection, &xcb_sync_id);
+    if (!ext || !ext->present) {
+        return -1;
+    }
+    first_event = ext->first_event;
+
+    xcb_sync_initialize_cookie_t init_cookie = xcb_sync_initialize(connection, XCB_SYNC_MAJOR_VERSION, XCB_SYNC_MINOR_VERSION);
+    xcb_sync_initialize_reply_t *init = xcb_sync_initialize_reply(connection, init_cookie, NULL);
+    if (!init) {
+        return -1;
+    }
+    free(init);
+
+    xcb_sync_list_system_counters_cookie_t cookie = xcb_sync_list_system_counters(connection);
+    xcb_sync_list_system_counters_reply_t *list = xcb_sync_list_system_counters_reply(connection, cookie, NULL);
+    if (!list) {
+        return -1;
+    }
+    xcb_sync_systemcounter_iterator_t it;
+    for (it = xcb_sync_list_system_counters_counters_iterator(list); it.rem; xcb_sync_systemcounter_next(&it)) {
+        if (it.data->name_len == strlen("IDLETIME")
+            && !strncmp(xcb_sync_systemcounter_name(it.data), "IDLETIME", it.data->name_len)) {
+            idle_counter = it.data->counter;
+            break;
+        }
+    }
+    free(list);
+    return idle_counter ? 0 : -1;
+}
+
+static int init_dimmer_fd(void) {
+    int fd = epoll_create1(EPOLL_CLOEXEC);
+    if (fd == -1) {
+        WARN("%s\n", strerror(errno));
+        return DONT_POLL_W_ERR;
+    }
+
+    timer_fd = start_timer(CLOCK_MONOTONIC, 0);
+    struct epoll_event xcb_ev = { .events = EPOLLIN, .data.fd = xcb_get_file_descriptor(connection) };
+    struct epoll_event timer_ev = { .events = EPOLLIN, .data.fd = timer_fd };
+    if (timer_fd == -1 || epoll_ctl(fd, EPOLL_CTL_ADD, xcb_ev.data.fd, &xcb_ev) == -1
+        || epoll_ctl(fd, EPOLL_CTL_ADD, timer_fd, &timer_ev) == -1) {
+        WARN("%s\n", strerror(errno));
+        close(fd);
+        return DONT_POLL_W_ERR;
+    }
+    return fd;
+}
+
+/*
+ * Create (or re-arm: alarms with a 0 delta become inactive once triggered) an alarm on IDLETIME counter.
+ * Value list follows XCB_SYNC_CA_* mask bits order; 64 bits values are sent as hi, lo.
+ */
+static void set_alarm(enum alarms a, int64_t value, uint32_t test) {
+    const uint32_t mask = XCB_SYNC_CA_COUNTER | XCB_SYNC_CA_VALUE_TYPE | XCB_SYNC_CA_VALUE
+                          | XCB_SYNC_CA_TEST_TYPE | XCB_SYNC_CA_DELTA | XCB_SYNC_CA_EVENTS;
+    const uint32_t values[] = {
+        idle_counter, XCB_SYNC_VALUETYPE_ABSOLUTE,
+        (uint32_t)(value >> 32), (uint32_t)value,
+        test, 0, 0, 1
+    };
+
+    if (!alarms[a]) {
+        alarms[a] = xcb_generate_id(connection);
+        xcb_sync_create_alarm(connection, alarms[a], mask, values);
+    } else {
+        xcb_sync_change_alarm(connection, alarms[a], mask, values);
+    }
+    xcb_flush(connection);
+}
+
+static void dimmer_cb(void) {
+    struct epoll_event evs[2];
+
+    COUNT(POLL_CNT);
+    int r = epoll_wait(main_p[DIMMER_IX].fd, evs, 2, 0);
+    for (int i = 0; i < r; i++) {
+        if (evs[i].data.fd == timer_fd) {
+            read_timer(timer_fd);
+            transition_co(&transition);
+        }
+    }
+    handle_alarms();
+}
+
+static void handle_alarms(void) {
+    xcb_generic_event_t *ev;
+
+    while ((ev = xcb_poll_for_event(connection))) {
+        if ((ev->response_type & ~0x80) == first_event + XCB_SYNC_ALARM_NOTIFY) {
+            xcb_sync_alarm_notify_event_t *notify = (xcb_sync_alarm_notify_event_t *)ev;
+            int64_t idle = ((int64_t)notify->counter_value.hi << 32) | notify->counter_value.lo;
+
+            if (notify->alarm == alarms[IDLE_ALARM] && !dimmed && is_inhibited()) {
+                /* do not dim while inhibited: idle alarm will be re-armed when inhibition ends */
+                INFO("User idle, but screensaver is inhibited. Not dimming.\n");
+            } else if (notify->alarm == alarms[IDLE_ALARM] && !dimmed) {
+                /* fire as soon as IDLETIME gets reset by user activity */
+                set_alarm(ACTIVITY_ALARM, idle - 1, XCB_SYNC_TESTTYPE_NEGATIVE_COMPARISON);
+                dim(idle);
+            } else if (notify->alarm == alarms[ACTIVITY_ALARM] && dimmed) {
+                set_alarm(IDLE_ALARM, (int64_t)conf.dimmer_timeout * 1000, XCB_SYNC_TESTTYPE_POSITIVE_COMPARISON);
+                undim();
+            }
+        }
+        free(ev);
+    }
+}
+
+/*
+ * When inhibition starts, restore screen if it is dimmed;
+ * when it ends, re-arm idle alarm (if user is already idle for long enough, it will fire immediately).
+ */
+static void inhibit_changed_cb(const struct event *ev) {
+    if (ev->inhibited && dimmed) {
+        undim();
+    }
+    set_alarm(IDLE_ALARM, (int64_t)conf.dimmer_timeout * 1000, XCB_SYNC_TESTTYPE_POSITIVE_COMPARISON);
+}
+
+/*
+ * Smoothly move backlight to conf.dimmer_pct, only if it is currently higher:
+ * our targets are capped ones (COMBINE_MIN), so that they never brighten screen.
+ */
+static void dim(int64_t idle) {
+    INFO("User idle for %lds. Dimming screen.\n", (long)(idle / 1000));
+    dimmed = 1;
+    struct event ev = { .type = DIMMED_CHANGED, .dimmed = 1 };
+    publish_event(&ev);
+
+    saved = get_output_value(BACKLIGHT_OUTPUT);
+    if (saved < 0) {
+        saved = 1.0;
+    }
+    level = saved;
+    target = conf.dimmer_pct;
+    if (target < level) {
+        start_transition();
+    } else {
+        target = level;
+    }
+}
+
+/*
+ * Smoothly restore backlight level we had before dimming.
+ * Screen is considered undimmed only once transition is completed.
+ */
+static void undim(void) {
+    INFO("User activity detected. Restoring screen backlight.\n");
+    target = saved;
+    start_transition();
+}
+
+/*
+ * If a transition is already running, it will just head to new target after its current step.
+ */
+static void start_transition(void) {
+    if (!CO_RUNNING(&transition)) {
+        transition_co(&transition);
+    }
+}
+
+/*
+ * Move our target towards "target" by DIMMER_STEP each DIMMER_STEP_TIMEOUT
+ * (or straight to it if smooth transitions are disabled).
+ * Once backlight is restored, our target is dropped.
+ */
+static int transition_co(struct coroutine *co) {
+    CO_BEGIN(co);
+    while (level != target) {
+        if (conf.no_smooth_transition) {
+            level = target;
+        } else if (level > target) {
+            level = fmax(level - DIMMER_STEP, target);
+        } else {
+            level = fmin(level + DIMMER_STEP, target);
+        }
+        if (level != target) {
+            set_output_target(BACKLIGHT_OUTPUT, producer, level);
+            CO_SLEEP(co, timer_fd, 0, DIMMER_STEP_TIMEOUT);
+        }
+    }
+
+    if (target == saved && dimmed) {
+        INFO("Screen backlight restored.\n");
+        clear_output_target(BACKLIGHT_OUTPUT, producer);
+        dimmed = 0;
+        struct event ev = { .type = DIMMED_CHANGED, .dimmed = 0 };
+        publish_event(&ev);
+    } else {
+        set_output_target(BACKLIGHT_OUTPUT, producer, level);
+    }
+    CO_END(co);
+}
+
+/*
+ * Whether captures and backlight changes should be suspended:
+ * screen is dimmed, or it is being restored.
+ */
+int is_dimmed(void) {
+    return dimmed;
+}
+
+/*
+ * Alarms are destroyed by X server together with our connection.
+ * If we're leaving while dimmed, just drop our target and restore backlight level.
+ */
+void destroy_dimmer(void) {
+    if (dimmed) {
+        clear_output_target(BACKLIGHT_OUTPUT, producer);
+        flush_outputs();
+    }
+    if (timer_fd != -1) {
+        close(timer_fd);
+    }
+    if (main_p[DIMMER_IX].fd > 0) {
+        close(main_p[DIMMER_IX].fd);
+    }
+    if (connection) {
+        xcb_disconnect(connection);
+    }
+}
@@ -1,14 +1,45 @@
 #include "../inc/dpms.h"
+#include "../inc/event.h"
+#include "../inc/upower.h"
+#include "../inc/stream.h"
 #include <xcb/dpms.h>
 #include <stdlib.h>
 
+static int init_info_notify(void);
+static void dpms_cb(void);
+static void handle_dpms_events(void);
+static void set_power_level(int level);
+static void dpms_timeouts_cb(const struct event *ev);
+static void set_dpms_timeouts(void);
+static void inhibit_changed_cb(const struct event *ev);
+static void hold_screen(void);
+static void release_screen(void);
+
 static xcb_connection_t *connection;
 static int dpms_enabled;
+static int last_power_level;
+static int info_notify;                                 // whether X server notifies us of power level changes
+static uint8_t dpms_opcode;                             // dpms extension major opcode, to recognize its events
+static xcb_dpms_get_timeouts_reply_t *old_timeouts;     // timeouts before we started, restored on exit
+static int current_timeout = -1;                        // dpms timeout currently set by us
+static int held;                                        // whether we are keeping screen on for an inhibitor
+static int held_dpms;                                   // whether DPMS was disabled by us, to be enabled again
+static xcb_get_screen_saver_reply_t *old_saver;         // X screensaver settings before we disabled it
 
 /**
- * Checks through xcb if DPMS is enabled for this xscreen
+ * Checks through xcb if DPMS is enabled for this xscreen.
+ * If X server supports DPMS 1.2, ask it to notify us of power level changes:
+ * DISPLAY_POWER_CHANGED events are then published as soon as screen gets blanked or woken up,
+ * and current power level is known without any round trip.
+ * Older servers do not notify anything: power level is then queried when needed,
+ * and no DISPLAY_POWER_CHANGED event is ever published.
+ * If requested, store current dpms timeouts and set our ones,
+ * then update them whenever state or power source changes.
+ * While screensaver is inhibited through us, screen is kept on.
  */
 void init_dpms(void) {
+    int fd = DONT_POLL;
+
     connection = xcb_connect(NULL, NULL);
 
     if (!xcb_connection_has_error(connection)) {
@@ -18,16 +49,161 @@ void init_dpms(void) {
         cookie = xcb_dpms_info(connection);
         info = xcb_dpms_info_reply(connection, cookie, NULL);
 
-        if (info->state) {
-            dpms_enabled = 1;
+        if (info) {
+            dpms_enabled = info->state;
+            last_power_level = info->power_level;
+            free(info);
         }
-        // avoid polling this
-        init_module(DONT_POLL, DPMS_IX, NULL, destroy_dpms);
-        free(info);
+
+        if (conf.manage_dpms && dpms_enabled) {
+            old_timeouts = xcb_dpms_get_timeouts_reply(connection, xcb_dpms_get_timeouts(connection), NULL);
+            set_dpms_timeouts();
+            subscribe_event(STATE_CHANGED, dpms_timeouts_cb);
+            subscribe_event(POWER_SOURCE_CHANGED, dpms_timeouts_cb);
+        }
+
+        subscribe_event(INHIBIT_CHANGED, inhibit_changed_cb);
+
+        if (init_info_notify() == 0) {
+            fd = xcb_get_file_descriptor(connection);
+        } else {
+            INFO("X server does not notify dpms changes. Display power events disabled.\n");
+        }
+        init_module(fd, DPMS_IX, dpms_cb, destroy_dpms);
     }
 }
 
+/*
+ * Select DPMS InfoNotify events (DPMS 1.2, X.Org server >= 21.1).
+ */
+static int init_info_notify(void) {
+    const xcb_query_extension_reply_t *ext = xcb_get_extension_data(connection, &xcb_dpms_id);
+    if (!ext || !ext->present) {
+        return -1;
+    }
 
+    xcb_dpms_get_version_reply_t *ver = xcb_dpms_get_version_reply(connection, xcb_dpms_get_version(connection, 1, 2), NULL);
+    if (!ver) {
+        return -1;
+    }
+    info_notify = ver->server_major_version > 1 || (ver->server_major_version == 1 && ver->server_minor_version >= 2);
+    free(ver);
+    if (!info_notify) {
+        return -1;
+    }
+
+    dpms_opcode = ext->major_opcode;
+    xcb_dpms_select_input(connection, XCB_DPMS_EVENT_MASK_INFO_NOTIFY);
+    xcb_flush(connection);
+    return 0;
+}
+
+static void dpms_cb(void) {
+    handle_dpms_events();
+}
+
+/*
+ * DPMS events are X generic events: they are recognized by extension opcode.
+ * Any reply awaited on our connection may have read them into xcb queue,
+ * so this must be called after each of them too, or our fd would not wake main poll.
+ */
+static void handle_dpms_events(void) {
+    xcb_generic_event_t *ev;
+
+    while ((ev = xcb_poll_for_event(connection))) {
+        xcb_ge_generic_event_t *ge = (xcb_ge_generic_event_t *)ev;
+        if ((ev->response_type & ~0x80) == XCB_GE_GENERIC && ge->extension == dpms_opcode
+            && ge->event_type == XCB_DPMS_INFO_NOTIFY) {
+            xcb_dpms_info_notify_event_t *notify = (xcb_dpms_info_notify_event_t *)ev;
+            dpms_enabled = notify->state;
+            set_power_level(notify->power_level);
+        }
+        free(ev);
+    }
+}
+
+static void set_power_level(int level) {
+    if (level != last_power_level) {
+        last_power_level = level;
+        struct event ev = { .type = DISPLAY_POWER_CHANGED, .dpms = level };
+        publish_event(&ev);
+    }
+}
+
+static void dpms_timeouts_cb(const struct event *ev) {
+    set_dpms_timeouts();
+}
+
+/*
+ * Set standby, suspend and off timeouts all to the one configured for current power source and state
+ * (as most desktop environments do), only if it changed.
+ */
+static void set_dpms_timeouts(void) {
+    int timeout = conf.dpms_timeouts[on_battery() ? ON_BATTERY : ON_AC][state.time];
+
+    if (timeout != current_timeout) {
+        xcb_dpms_set_timeouts(connection, timeout, timeout, timeout);
+        xcb_flush(connection);
+        current_timeout = timeout;
+        INFO("Dpms timeout set to %ds.\n", timeout);
+        STREAM("dpms_timeout", "\"timeout\":%d", timeout);
+    }
+}
+
+
+
+/*
+ * INHIBIT_CHANGED is only published when we own org.freedesktop.ScreenSaver:
+ * then nobody else will honor inhibitors, so we must keep screen on ourselves.
+ */
+static void inhibit_changed_cb(const struct event *ev) {
+    if (ev->inhibited) {
+        hold_screen();
+    } else {
+        release_screen();
+    }
+}
+
+/*
+ * Disable DPMS and X screensaver (a 0 timeout disables it), storing their settings.
+ */
+static void hold_screen(void) {
+    if (held) {
+        return;
+    }
+    held = 1;
+    if (dpms_enabled) {
+        xcb_dpms_disable(connection);
+        held_dpms = 1;
+    }
+    old_saver = xcb_get_screen_saver_reply(connection, xcb_get_screen_saver(connection), NULL);
+    if (old_saver && old_saver->timeout) {
+        xcb_set_screen_saver(connection, 0, old_saver->interval, old_saver->prefer_blanking, old_saver->allow_exposures);
+    }
+    xcb_flush(connection);
+    handle_dpms_events();
+    INFO("Screensaver inhibited: dpms and screensaver disabled.\n");
+}
+
+static void release_screen(void) {
+    if (!held) {
+        return;
+    }
+    held = 0;
+    if (held_dpms) {
+        xcb_dpms_enable(connection);
+        held_dpms = 0;
+    }
+    if (old_saver) {
+        if (old_saver->timeout) {
+            xcb_set_screen_saver(connection, old_saver->timeout, old_saver->interval, old_saver->prefer_blanking, old_saver->allow_exposures);
+        }
+        free(old_saver);
+        old_saver = NULL;
+    }
+    xcb_flush(connection);
+    INFO("Screensaver uninhibited: dpms and screensaver restored.\n");
+}
 
 /**
  * info->power_level is one of:
@@ -36,12 +212,18 @@ void init_dpms(void) {
  * 1     DPMSModeStandby     Blanked, low power
  * 2     DPMSModeSuspend     Blanked, lower power
  * 3     DPMSModeOff         Shut off, awaiting activity
+ * If X server notifies us of changes, last notified level is returned.
  */
 int get_screen_dpms(void) {
     xcb_dpms_info_cookie_t cookie;
     xcb_dpms_info_reply_t *info;
     int ret = -1;
 
+    if (info_notify) {
+        handle_dpms_events();
+        return dpms_enabled ? last_power_level : -1;
+    }
+
     if (!dpms_enabled) {
         return ret;
     }
@@ -57,6 +239,12 @@ int get_screen_dpms(void) {
 }
 
 void destroy_dpms(void) {
+    release_screen();
+    if (old_timeouts) {
+        xcb_dpms_set_timeouts(connection, old_timeouts->standby_timeout, old_timeouts->suspend_timeout, old_timeouts->off_timeout);
+        xcb_flush(connection);
+        free(old_timeouts);
+    }
     if (connection) {
         xcb_disconnect(connection);
     }
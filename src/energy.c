@@ -0,0 +1,207 @@
+#include "../inc/energy.h"
+#include "../inc/stream.h"
+#include <dirent.h>
+#include <fcntl.h>
+
+#define POWERCAP_DIR "/sys/class/powercap"
+#define MAX_RAPL_DOMAINS 8
+#define DEFAULT_TDP 250000000       // uW, used when a package does not expose its max power
+#define MAX_UPDATE_TIMEOUT 3600     // seconds
+
+static void energy_cb(void);
+static void update_energy(void);
+static int read_uj(int fd, uint64_t *val);
+
+/*
+ * A RAPL package domain (intel-rapl:N): its energy_uj counter wraps around at max_energy_range_uj.
+ */
+struct rapl_domain {
+    int fd;                         // energy_uj fd, kept open and read with pread
+    uint64_t max;                   // max_energy_range_uj
+    uint64_t last;                  // last read energy_uj value
+};
+
+/*
+ * Energy spent by each activity, and by the whole system since we started, in uJ.
+ */
+struct energy {
+    uint64_t total;
+    uint64_t begin[SIZE_ACTIVITIES];
+    uint64_t spent[SIZE_ACTIVITIES];
+    int count[SIZE_ACTIVITIES];
+    time_t start;
+};
+
+static struct rapl_domain domains[MAX_RAPL_DOMAINS];
+static int num_domains;
+static int update_timeout = MAX_UPDATE_TIMEOUT;  // seconds between counters reads, so that no wrap around is missed
+static struct energy en;
+static const char *activities_dict[SIZE_ACTIVITIES] = {"capture", "gamma"};
+
+/*
+ * Open energy counter of every RAPL package domain (subzones like intel-rapl:0:0
+ * are already accounted in their package).
+ * Note that these counters measure whole system energy: energy spent during an activity
+ * includes anything else system was doing meanwhile.
+ * Recent kernels only let root read them: in that case, energy accounting is just disabled.
+ */
+void init_energy(void) {
+    DIR *d = opendir(POWERCAP_DIR);
+    struct dirent *entry;
+
+    if (!d) {
+        return INFO("RAPL powercap interface not available. Energy accounting disabled.\n");
+    }
+
+    while ((entry = readdir(d)) && num_domains < MAX_RAPL_DOMAINS) {
+        unsigned int pkg;
+        char tail;
+        if (sscanf(entry->d_name, "intel-rapl:%u%c", &pkg, &tail) != 1) {
+            continue;
+        }
+
+        char path[PATH_MAX + 1];
+        struct rapl_domain *dom = &domains[num_domains];
+
+        snprintf(path, PATH_MAX, "%s/%s/max_energy_range_uj", POWERCAP_DIR, entry->d_name);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            continue;
+        }
+        int r = read_uj(fd, &dom->max);
+        close(fd);
+
+        /*
+         * At full power (that can exceed TDP for short periods), counter wraps in max / TDP seconds:
+         * read it 4 times as often.
+         */
+        uint64_t tdp = 0;
+        snprintf(path, PATH_MAX, "%s/%s/constraint_0_max_power_uw", POWERCAP_DIR, entry->d_name);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd != -1) {
+            read_uj(fd, &tdp);
+            close(fd);
+        }
+        if (tdp == 0) {
+            tdp = DEFAULT_TDP;
+        }
+        if (r == 0 && dom->max / tdp / 4 < (uint64_t)update_timeout) {
+            update_timeout = dom->max / tdp / 4 > 0 ? dom->max / tdp / 4 : 1;
+        }
+
+        snprintf(path, PATH_MAX, "%s/%s/energy_uj", POWERCAP_DIR, entry->d_name);
+        dom->fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (r == -1 || dom->fd == -1 || read_uj(dom->fd, &dom->last) == -1) {
+            if (dom->fd != -1) {
+                close(dom->fd);
+            }
+            continue;
+        }
+        num_domains++;
+    }
+    closedir(d);
+
+    if (num_domains == 0) {
+        return INFO("No readable RAPL energy counter. Energy accounting disabled.\n");
+    }
+    en.start = get_monotonic_time();
+    INFO("Reading RAPL energy counters every %d seconds.\n", update_timeout);
+    int fd = start_timer(CLOCK_MONOTONIC, update_timeout);
+    init_module(fd, ENERGY_IX, energy_cb, destroy_energy);
+}
+
+/*
+ * Counters must be read at least once for each wrap around, even if no activity took place.
+ */
+static void energy_cb(void) {
+    read_timer(main_p[ENERGY_IX].fd);
+    update_energy();
+    set_timeout(update_timeout, 0, main_p[ENERGY_IX].fd, 0);
+}
+
+static int read_uj(int fd, uint64_t *val) {
+    char buf[32] = {0};
+
+    if (pread(fd, buf, sizeof(buf) - 1, 0) <= 0) {
+        return -1;
+    }
+    *val = strtoull(buf, NULL, 10);
+    return 0;
+}
+
+/*
+ * Add to en.total energy spent since last update, handling counters wrap around.
+ * energy_cb() calls us often enough to only see a single wrap.
+ */
+static void update_energy(void) {
+    for (int i = 0; i < num_domains; i++) {
+        uint64_t val;
+        if (read_uj(domains[i].fd, &val) == -1) {
+            continue;
+        }
+        if (val >= domains[i].last) {
+            en.total += val - domains[i].last;
+        } else {
+            en.total += domains[i].max - domains[i].last + val;
+        }
+        domains[i].last = val;
+    }
+}
+
+void energy_begin(enum activities a) {
+    if (modules[ENERGY_IX].inited) {
+        update_energy();
+        en.begin[a] = en.total;
+    }
+}
+
+/*
+ * Attribute energy spent since energy_begin(a) to activity a.
+ * Returns it in joules.
+ */
+double energy_end(enum activities a) {
+    if (!modules[ENERGY_IX].inited) {
+        return 0.0;
+    }
+
+    update_energy();
+    uint64_t spent = en.total - en.begin[a];
+    en.spent[a] += spent;
+    en.count[a]++;
+    STREAM("energy", "\"activity\":\"%s\",\"joules\":%.3lf", activities_dict[a], spent / 1000000.0);
+    return spent / 1000000.0;
+}
+
+/*
+ * Log energy spent by each activity (total, per activity and per day)
+ * and by the system while we were idle.
+ */
+void log_energy_stats(void) {
+    if (!modules[ENERGY_IX].inited) {
+        return;
+    }
+
+    update_energy();
+    time_t elapsed = get_monotonic_time() - en.start;
+    double days = elapsed > 0 ? (double)elapsed / (24 * 60 * 60) : 1.0;
+    uint64_t idle = en.total;
+
+    INFO("Energy stats over %ld seconds:\n", (long)elapsed);
+    for (int i = 0; i < SIZE_ACTIVITIES; i++) {
+        idle -= en.spent[i];
+        INFO("* %s: %d times, %.3lf J (%.3lf J each, %.1lf J per day)\n", activities_dict[i], en.count[i],
+             en.spent[i] / 1000000.0, en.count[i] ? en.spent[i] / 1000000.0 / en.count[i] : 0.0,
+             en.spent[i] / 1000000.0 / days);
+    }
+    INFO("* idle: %.3lf J (%.1lf J per day)\n", idle / 1000000.0, idle / 1000000.0 / days);
+}
+
+void destroy_energy(void) {
+    log_energy_stats();
+    for (int i = 0; i < num_domains; i++) {
+        close(domains[i].fd);
+    }
+    if (main_p[ENERGY_IX].fd > 0) {
+        close(main_p[ENERGY_IX].fd);
+    }
+}
@@ -0,0 +1,330 @@
+#include "../inc/evaluator.h"
+#include "../inc/frames.h"
+#include <pthread.h>
+
+#define LABELS_FILE "labels"        // name of labels file inside dataset dir
+#define EXPOSURE_REF 100            // exposure (in 100us units) exposure normalized estimates are scaled to
+#define EST_EPS (1.0 / 255)         // avoids log(0) for completely dark frames
+#define ERROR_TOLERANCE 1.1         // estimators whose error is within 10% of best one are considered as good
+
+/* A labeled frame of the dataset */
+struct eval_sample {
+    struct frame_source *src;
+    struct frame f;                 // frame data is mmapped from its file
+    double lux;
+    int exposure;                   // absolute exposure used to take frame, in 100us units; 0 if unknown
+};
+
+/* Ambient brightness estimator: returns an estimate, not necessarily between 0.0 and 1.0 */
+struct estimator {
+    const char *name;
+    double (*fn)(const struct eval_sample *s);
+};
+
+/* Evaluation results for an estimator */
+struct eval_result {
+    const struct estimator *e;
+    double *estimates;
+    double cpu_ns;                  // cpu time spent on the whole dataset, in ns
+    double error;                   // rms error of fitted log10(lux), ie: estimated lux is off by a 10^error factor
+    double r;                       // correlation between log10(estimate) and log10(lux)
+};
+
+static int load_dataset(const char *dir, struct eval_sample **samples);
+static void run_estimators(const struct eval_sample *samples, int num_samples, struct eval_result *results);
+static void *eval_thread(void *arg);
+static void fit(const struct eval_sample *samples, int num_samples, struct eval_result *res);
+static int cmp_results(const void *a, const void *b);
+static void print_results(const struct eval_result *results, int num_samples);
+static double mean_estimator(const struct eval_sample *s);
+static double percentile(const struct frame *f, double p);
+static double median_estimator(const struct eval_sample *s);
+static double p90_estimator(const struct eval_sample *s);
+static double roi_estimator(const struct eval_sample *s);
+static double exposure_estimator(const struct eval_sample *s);
+
+static const struct estimator estimators[] = {
+    { "mean", mean_estimator },
+    { "median", median_estimator },
+    { "p90", p90_estimator },
+    { "roi", roi_estimator },
+    { "exposure", exposure_estimator }
+};
+
+#define SIZE(a) (int)(sizeof(a) / sizeof(*a))
+
+static int use_exposure;            // whether every frame of dataset has its exposure
+
+/* Work assigned to each evaluation thread */
+struct eval_job {
+    const struct eval_sample *samples;
+    int num_samples;
+    struct eval_result *results;
+    int first;
+    int step;
+    double cpu_ns[SIZE(estimators)];                // per estimator cpu time spent by this thread
+};
+
+
+/*
+ * Run every estimator on every frame of dataset in conf.evaluate_dir, spreading frames on every cpu.
+ * Each estimator gets a log-log least squares fit against lux labels (camera response is roughly a power law),
+ * then estimators are ranked by fit error; cpu time per frame is reported too.
+ */
+void evaluate(void) {
+    struct eval_sample *samples = NULL;
+    struct eval_result results[SIZE(estimators)] = {{ 0 }};
+
+    int num_samples = load_dataset(conf.evaluate_dir, &samples);
+    if (num_samples < 3) {
+        WARN("Not enough labeled frames in %s.\n", conf.evaluate_dir);
+        goto end;
+    }
+
+    /* normalized and raw means cannot be fitted together */
+    use_exposure = 1;
+    for (int i = 0; i < num_samples && use_exposure; i++) {
+        use_exposure = samples[i].exposure > 0;
+    }
+    if (!use_exposure) {
+        INFO("Not every frame has its exposure: exposure estimator will not normalize any.\n");
+    }
+
+    for (int i = 0; i < SIZE(estimators); i++) {
+        results[i].e = &estimators[i];
+        results[i].estimates = calloc(num_samples, sizeof(double));
+        if (!results[i].estimates) {
+            WARN("%s\n", strerror(errno));
+            goto end;
+        }
+    }
+
+    run_estimators(samples, num_samples, results);
+    for (int i = 0; i < SIZE(estimators); i++) {
+        fit(samples, num_samples, &results[i]);
+    }
+    qsort(results, SIZE(estimators), sizeof(struct eval_result), cmp_results);
+    print_results(results, num_samples);
+
+end:
+    for (int i = 0; i < SIZE(estimators); i++) {
+        free(results[i].estimates);
+    }
+    for (int i = 0; i < num_samples; i++) {
+        close_frame_source(samples[i].src);
+    }
+    free(samples);
+}
+
+/*
+ * Dataset dir contains raw frames files, plus a "labels" file whose lines are
+ * "<frame file> <width>x<height> <grey|yuyv> <lux> [exposure]"; lines starting with '#' are skipped.
+ * Frames are mmapped, not copied.
+ */
+static int load_dataset(const char *dir, struct eval_sample **samples) {
+    char path[PATH_MAX + 1], line[PATH_MAX + 128];
+    int num = 0, size = 0;
+
+    snprintf(path, PATH_MAX, "%s/%s", dir, LABELS_FILE);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        WARN("%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        char name[PATH_MAX + 1], geometry[32], fmt[8], spec[2 * PATH_MAX];
+        struct eval_sample s = {0};
+
+        if (line[0] == '#' || sscanf(line, "%4096s %31s %7s %lf %d", name, geometry, fmt, &s.lux, &s.exposure) < 4) {
+            continue;
+        }
+        snprintf(spec, sizeof(spec), "file:%s/%s:%s:%s", dir, name, geometry, fmt);
+        if (!(s.src = open_frame_source(spec)) || next_frame(s.src, &s.f, 0) == -1) {
+            continue;
+        }
+        if (num == size) {
+            size = size ? 2 * size : 64;
+            struct eval_sample *tmp = realloc(*samples, size * sizeof(struct eval_sample));
+            if (!tmp) {
+                close_frame_source(s.src);
+                break;
+            }
+            *samples = tmp;
+        }
+        (*samples)[num++] = s;
+    }
+    fclose(f);
+    return num;
+}
+
+/*
+ * Frames are interleaved between threads; each thread measures its own cpu time for each estimator.
+ * Estimates are stored at frame index, so results do not depend on threads scheduling.
+ */
+static void run_estimators(const struct eval_sample *samples, int num_samples, struct eval_result *results) {
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads < 1) {
+        num_threads = 1;
+    } else if (num_threads > num_samples) {
+        num_threads = num_samples;
+    }
+
+    pthread_t threads[num_threads];
+    struct eval_job jobs[num_threads];
+    int started[num_threads];
+    for (int i = 0; i < num_threads; i++) {
+        jobs[i] = (struct eval_job) { samples, num_samples, results, i, num_threads, { 0 } };
+        started[i] = pthread_create(&threads[i], NULL, eval_thread, &jobs[i]) == 0;
+        if (!started[i]) {
+            /* could not start a new thread: run this job in main thread */
+            eval_thread(&jobs[i]);
+        }
+    }
+    for (int i = 0; i < num_threads; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+        for (int j = 0; j < SIZE(estimators); j++) {
+            results[j].cpu_ns += jobs[i].cpu_ns[j];
+        }
+    }
+}
+
+static void *eval_thread(void *arg) {
+    struct eval_job *job = (struct eval_job *)arg;
+    struct timespec start, end;
+
+    /* untimed warm up pass, so that first estimator is not charged with cold caches */
+    for (int i = job->first; i < job->num_samples; i += job->step) {
+        mean_estimator(&job->samples[i]);
+    }
+
+    for (int j = 0; j < SIZE(estimators); j++) {
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+        for (int i = job->first; i < job->num_samples; i += job->step) {
+            job->results[j].estimates[i] = job->results[j].e->fn(&job->samples[i]);
+        }
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+        job->cpu_ns[j] += (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    }
+    return NULL;
+}
+
+/*
+ * Least squares fit of log10(lux + 1) = a * log10(estimate) + b.
+ */
+static void fit(const struct eval_sample *samples, int num_samples, struct eval_result *res) {
+    double sx = 0, sy = 0, sxx = 0, syy = 0, sxy = 0;
+
+    for (int i = 0; i < num_samples; i++) {
+        const double x = log10(res->estimates[i] + EST_EPS);
+        const double y = log10(samples[i].lux + 1);
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        syy += y * y;
+        sxy += x * y;
+    }
+
+    const double n = num_samples;
+    const double vx = n * sxx - sx * sx, vy = n * syy - sy * sy;
+    const double a = vx > 0 ? (n * sxy - sx * sy) / vx : 0;
+    const double b = (sy - a * sx) / n;
+    res->r = vx > 0 && vy > 0 ? (n * sxy - sx * sy) / sqrt(vx * vy) : 0;
+
+    double err = 0;
+    for (int i = 0; i < num_samples; i++) {
+        const double d = a * log10(res->estimates[i] + EST_EPS) + b - log10(samples[i].lux + 1);
+        err += d * d;
+    }
+    res->error = sqrt(err / n);
+}
+
+static int cmp_results(const void *a, const void *b) {
+    const struct eval_result *r1 = (const struct eval_result *)a;
+    const struct eval_result *r2 = (const struct eval_result *)b;
+
+    return (r1->error > r2->error) - (r1->error < r2->error);
+}
+
+/*
+ * Recommended estimator is cheapest one among those whose error is close enough to best one.
+ */
+static void print_results(const struct eval_result *results, int num_samples) {
+    const struct eval_result *best = &results[0];
+
+    printf("%-10s %-10s %-8s %-10s %-12s\n", "estimator", "error(x)", "r", "ns/frame", "frames/s");
+    for (int i = 0; i < SIZE(estimators); i++) {
+        const struct eval_result *r = &results[i];
+        const double ns = r->cpu_ns / num_samples;
+        printf("%-10s %-10.3lf %-8.3lf %-10.0lf %-12.0lf\n", r->e->name, pow(10, r->error), r->r, ns, ns > 0 ? 1e9 / ns : 0);
+        if (r->error <= results[0].error * ERROR_TOLERANCE && r->cpu_ns < best->cpu_ns) {
+            best = r;
+        }
+    }
+    printf("\n%d labeled frames evaluated. Best accuracy per cpu time: %s.\n", num_samples, best->e->name);
+}
+
+static double mean_estimator(const struct eval_sample *s) {
+    return frame_brightness(&s->f);
+}
+
+/*
+ * Luma value (between 0.0 and 1.0) under which p fraction of pixels lie, from a 256 bins histogram.
+ */
+static double percentile(const struct frame *f, double p) {
+    const int step = f->fmt == YUYV_FMT ? 2 : 1;
+    const size_t num = (size_t)f->width * f->height;
+    size_t hist[256] = {0};
+
+    for (size_t i = 0; i < num; i++) {
+        hist[f->data[i * step]]++;
+    }
+
+    size_t count = 0;
+    for (int i = 0; i < 256; i++) {
+        count += hist[i];
+        if (count >= p * num) {
+            return i / 255.0;
+        }
+    }
+    return 1.0;
+}
+
+static double median_estimator(const struct eval_sample *s) {
+    return percentile(&s->f, 0.5);
+}
+
+/* Highlights track light sources */
+static double p90_estimator(const struct eval_sample *s) {
+    return percentile(&s->f, 0.9);
+}
+
+/*
+ * Mean of central area (half width, half height), that is less likely
+ * to be covered by user, whose face is usually in lower part of frame.
+ */
+static double roi_estimator(const struct eval_sample *s) {
+    const struct frame *f = &s->f;
+    const int step = f->fmt == YUYV_FMT ? 2 : 1;
+    uint64_t sum = 0;
+
+    for (int y = f->height / 4; y < 3 * f->height / 4; y++) {
+        const uint8_t *row = f->data + (size_t)y * f->width * step;
+        for (int x = f->width / 4; x < 3 * f->width / 4; x++) {
+            sum += row[x * step];
+        }
+    }
+    const size_t num = (size_t)(3 * f->height / 4 - f->height / 4) * (3 * f->width / 4 - f->width / 4);
+    return num ? (double)sum / (num * 255) : 0;
+}
+
+/*
+ * Undo auto exposure: same scene brightness gives a brighter frame with a longer exposure.
+ * Same as mean estimator if some frames of dataset lack their exposure.
+ */
+static double exposure_estimator(const struct eval_sample *s) {
+    const double mean = frame_brightness(&s->f);
+    return use_exposure ? mean * EXPOSURE_REF / s->exposure : mean;
+}
@@ -0,0 +1,89 @@
+#include "../inc/event.h"
+
+#define MAX_DISPATCH_ROUNDS 4       // max rounds of dispatching, as subscribers may publish new events
+
+static const char *dict[EVENT_TYPES_NUM] = {"LocationChanged", "StateChanged", "AmbientMeasured", "DisplayPowerChanged", "DimmedChanged", "PowerSourceChanged", "InhibitChanged", "AmbientTempMeasured"};
+
+/*
+ * Subscribers and pending (already coalesced) event for each event type.
+ */
+struct topic {
+    event_cb subscribers[MAX_SUBSCRIBERS];
+    int num_subscribers;
+    int pending;
+    struct event ev;
+};
+
+static struct topic topics[EVENT_TYPES_NUM];
+
+/*
+ * Register cb to be called whenever an event of type "type" is dispatched.
+ */
+void subscribe_event(enum event_types type, event_cb cb) {
+    struct topic *t = &topics[type];
+
+    if (t->num_subscribers == MAX_SUBSCRIBERS) {
+        return WARN("Too many subscribers for %s event.\n", dict[type]);
+    }
+    t->subscribers[t->num_subscribers++] = cb;
+}
+
+/*
+ * Queue an event: it will be dispatched by main poll at the end of current iteration.
+ * If an event of same type is already pending, it is replaced by this one,
+ * but an already pending STATE_CHANGED keeps its old state.
+ */
+void publish_event(const struct event *ev) {
+    struct topic *t = &topics[ev->type];
+
+    if (t->num_subscribers == 0) {
+        return;
+    }
+
+    if (t->pending && ev->type == STATE_CHANGED) {
+        enum states old = t->ev.state.old;
+        t->ev = *ev;
+        t->ev.state.old = old;
+    } else {
+        t->ev = *ev;
+    }
+    t->pending = 1;
+}
+
+/*
+ * Dispatch every pending event to its subscribers, once per event type.
+ * As subscribers may publish new events, repeat while there are pending ones,
+ * for at most MAX_DISPATCH_ROUNDS rounds; any remaining event will be dispatched
+ * during next main poll iteration.
+ * Returns number of events still pending.
+ */
+int dispatch_events(void) {
+    for (int round = 0; round < MAX_DISPATCH_ROUNDS; round++) {
+        int dispatched = 0;
+
+        for (int i = 0; i < EVENT_TYPES_NUM && !state.quit; i++) {
+            struct topic *t = &topics[i];
+            if (!t->pending) {
+                continue;
+            }
+
+            /* copy event as subscribers may publish a new one of same type */
+            struct event ev = t->ev;
+            t->pending = 0;
+            dispatched++;
+            for (int j = 0; j < t->num_subscribers; j++) {
+                t->subscribers[j](&ev);
+            }
+        }
+
+        if (!dispatched) {
+            return 0;
+        }
+    }
+
+    int pending = 0;
+    for (int i = 0; i < EVENT_TYPES_NUM; i++) {
+        pending += topics[i].pending;
+    }
+    return pending;
+}
@@ -0,0 +1,271 @@
+#include "../inc/flicker.h"
+#include "../inc/camera.h"
+#include "../inc/cities.h"
+#include "../inc/stream.h"
+
+#define FLICKER_CACHE "clight_flicker"  // cache file name, in $XDG_CACHE_HOME (or $HOME/.cache)
+#define MAX_FLICKER_ENTRIES 32          // cached (device, location) pairs
+#define FLICKER_COLS 64                 // row means are sampled on at most FLICKER_COLS pixels
+#define FLICKER_ROWS 1080               // only first FLICKER_ROWS rows of taller frames are analyzed
+#define DEFAULT_FPS 30                  // frame rate assumed when source does not report it
+#define MIN_LUMA 0.02                   // frames darker than this are not analyzed
+#define MIN_DEPTH 0.02                  // weakest banding (relative to frame brightness) considered as flicker
+#define FLICKER_SNR 4.0                 // banding power must be this much stronger than off-mains one
+#define JP_MAINS_LON 138.0              // Japan: east of this longitude grid is 50Hz, west of it 60Hz
+
+static double banding_power(const double *rows, int num, double freq);
+static int location_mains_hz(void);
+static void cache_path(char *path);
+static int load_cached(const char *key);
+static void store_cached(const char *key, int hz);
+static int update_current(const char *device, int use_cache);
+
+/* Countries (besides western Japan) with a 60Hz grid */
+static const char *mains60_cc[] = {
+    "US", "CA", "MX", "GT", "BZ", "SV", "HN", "NI", "CR", "PA", "CU", "DO", "HT", "PR", "BS", "TT",
+    "CO", "VE", "EC", "PE", "BR", "GY", "SR", "KR", "TW", "PH", "SA", "LR"
+};
+
+/* off-mains frequencies, relative to 100Hz: away from 120Hz and from second harmonics */
+static const double noise_freqs[] = { 0.5, 0.7, 1.5, 1.7 };
+
+/* Mains frequency for current device and location */
+static struct {
+    char key[PATH_MAX + 64];        // "<device> <lat> <lon>", location rounded to ~10km
+    int hz;                         // 0 if unknown
+    int detected;                   // whether hz was detected from frames, or only guessed from location
+} cur;
+
+/*
+ * A rolling shutter exposes each row a bit later than previous one, so light flicker
+ * (at twice mains frequency) shows up as horizontal bands, whose period in rows only depends
+ * on flicker frequency and rows readout rate (ie: frame height * fps, neglecting vertical blanking).
+ * Row means are detrended (scene gradients) and normalized by frame brightness,
+ * then banding power is measured at 100Hz and 120Hz, and at some off-mains frequencies as noise reference.
+ */
+void flicker_add_frame(struct flicker_detector *d, const struct frame *f) {
+    const int step = f->fmt == YUYV_FMT ? 2 : 1;
+    const int sx = f->width > FLICKER_COLS ? f->width / FLICKER_COLS : 1;
+    const double row_rate = (f->fps > 0 ? f->fps : DEFAULT_FPS) * f->height;
+    const int height = f->height < FLICKER_ROWS ? f->height : FLICKER_ROWS;
+    double rows[FLICKER_ROWS];
+    double mean = 0, sy = 0, sxy = 0;
+
+    if (height < 2) {
+        return;
+    }
+    for (int y = 0; y < height; y++) {
+        const uint8_t *row = f->data + (size_t)y * f->width * step;
+        uint64_t sum = 0, num = 0;
+        for (int x = 0; x < f->width; x += sx) {
+            sum += row[x * step];
+            num++;
+        }
+        rows[y] = (double)sum / (num * 255);
+        mean += rows[y];
+    }
+    mean /= height;
+    if (mean < MIN_LUMA) {
+        return;
+    }
+
+    /* least squares line through row means */
+    const double yc = (height - 1) / 2.0;
+    for (int y = 0; y < height; y++) {
+        sy += (y - yc) * (y - yc);
+        sxy += (y - yc) * rows[y];
+    }
+    const double slope = sxy / sy;
+    for (int y = 0; y < height; y++) {
+        rows[y] = (rows[y] - mean - slope * (y - yc)) / mean;
+    }
+
+    d->power[0] += banding_power(rows, height, 100 / row_rate);
+    d->power[1] += banding_power(rows, height, 120 / row_rate);
+    for (int i = 0; i < (int)(sizeof(noise_freqs) / sizeof(*noise_freqs)); i++) {
+        d->noise += banding_power(rows, height, noise_freqs[i] * 100 / row_rate) / (sizeof(noise_freqs) / sizeof(*noise_freqs));
+    }
+    d->frames++;
+}
+
+/*
+ * Power of rows at freq cycles per row; a sinusoid of amplitude A gets A^2 / 4.
+ * No window: 100Hz and 120Hz bands are less than a DFT bin apart, a window would blur them together.
+ */
+static double banding_power(const double *rows, int num, double freq) {
+    double re = 0, im = 0;
+
+    for (int i = 0; i < num; i++) {
+        re += rows[i] * cos(2 * M_PI * freq * i);
+        im -= rows[i] * sin(2 * M_PI * freq * i);
+    }
+    return (re * re + im * im) / ((double)num * num);
+}
+
+/*
+ * Mains frequency whose flicker is seen in analyzed frames: 50, 60, or 0 if no flicker was found.
+ */
+int flicker_result(const struct flicker_detector *d) {
+    if (d->frames == 0) {
+        return 0;
+    }
+    const int best = d->power[1] > d->power[0];
+    if (d->power[best] < FLICKER_SNR * d->noise || d->power[best] / d->frames < MIN_DEPTH * MIN_DEPTH / 4) {
+        return 0;
+    }
+    return best ? 60 : 50;
+}
+
+/*
+ * Guess mains frequency from country of nearest city in our (small) cities table: a default, not a detection,
+ * that can be wrong near borders or in countries with both grids. 0 if location is unknown.
+ */
+static int location_mains_hz(void) {
+    if (conf.lat == 0 && conf.lon == 0) {
+        return 0;
+    }
+    const char *cc = nearest_city_country(conf.lat, conf.lon);
+    if (!cc) {
+        return 0;
+    }
+    if (!strcmp(cc, "JP")) {
+        return conf.lon < JP_MAINS_LON ? 60 : 50;
+    }
+    for (int i = 0; i < (int)(sizeof(mains60_cc) / sizeof(*mains60_cc)); i++) {
+        if (!strcmp(cc, mains60_cc[i])) {
+            return 60;
+        }
+    }
+    return 50;
+}
+
+static void cache_path(char *path) {
+    if (getenv("XDG_CACHE_HOME")) {
+        snprintf(path, PATH_MAX, "%s/%s", getenv("XDG_CACHE_HOME"), FLICKER_CACHE);
+    } else {
+        snprintf(path, PATH_MAX, "%s/.cache/%s", getpwuid(getuid())->pw_dir, FLICKER_CACHE);
+    }
+}
+
+/*
+ * Cache file lines are "<key> <hz>", most recently detected first.
+ * Returns cached mains frequency for key, 0 if not found.
+ */
+static int load_cached(const char *key) {
+    char path[PATH_MAX + 1], line[PATH_MAX + 128];
+    int hz = 0;
+
+    cache_path(path);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return 0;
+    }
+    while (!hz && fgets(line, sizeof(line), f)) {
+        char *val = strrchr(line, ' ');
+        if (val && (size_t)(val - line) == strlen(key) && !strncmp(line, key, val - line)) {
+            hz = atoi(val + 1);
+        }
+    }
+    fclose(f);
+    return hz == 50 || hz == 60 ? hz : 0;
+}
+
+/*
+ * Rewrite cache with key first, keeping at most MAX_FLICKER_ENTRIES entries.
+ * Written to a temporary file then renamed, so that it is never left half written.
+ */
+static void store_cached(const char *key, int hz) {
+    char path[PATH_MAX + 1], tmp[PATH_MAX + 8], line[PATH_MAX + 128];
+
+    cache_path(path);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *out = fopen(tmp, "w");
+    if (!out) {
+        return WARN("Failed to cache flicker frequency: %s\n", strerror(errno));
+    }
+    fprintf(out, "%s %d\n", key, hz);
+
+    FILE *in = fopen(path, "r");
+    if (in) {
+        int num = 1;
+        while (num < MAX_FLICKER_ENTRIES && fgets(line, sizeof(line), in)) {
+            char *val = strrchr(line, ' ');
+            if (val && !((size_t)(val - line) == strlen(key) && !strncmp(line, key, val - line))) {
+                fputs(line, out);
+                num++;
+            }
+        }
+        fclose(in);
+    }
+    if (fclose(out) == 0) {
+        rename(tmp, path);
+    } else {
+        remove(tmp);
+    }
+}
+
+/*
+ * Refresh mains frequency when device or location changed: if use_cache, a frequency detected there before wins,
+ * otherwise location one is used. Returns 1 if it changed.
+ */
+static int update_current(const char *device, int use_cache) {
+    char key[sizeof(cur.key)];
+
+    snprintf(key, sizeof(key), "%s %.1lf %.1lf", device, conf.lat, conf.lon);
+    if (!strcmp(key, cur.key)) {
+        return 0;
+    }
+    strncpy(cur.key, key, sizeof(cur.key) - 1);
+    cur.hz = use_cache ? load_cached(key) : 0;
+    cur.detected = cur.hz != 0;
+    if (!cur.detected) {
+        cur.hz = location_mains_hz();
+    }
+    return 1;
+}
+
+/*
+ * Before a capture through clightd. We do not get its frames, so flicker cannot be detected:
+ * webcam anti flicker is just set to mains frequency guessed from location.
+ */
+void set_camera_flicker(void) {
+    if (conf.no_flicker || !update_current(camera_sysname(), 0) || !cur.hz) {
+        return;
+    }
+    if (set_camera_power_line(cur.hz) == 0) {
+        INFO("Webcam anti flicker set to %dHz, mains frequency guessed from location.\n", cur.hz);
+        STREAM("flicker", "\"hz\":%d,\"detected\":0", cur.hz);
+    }
+}
+
+/*
+ * Before a capture from a frame source: set its anti flicker to known frequency, if any.
+ * Returns 1 if flicker still has to be detected on capture frames.
+ */
+int set_source_flicker(struct frame_source *src, const char *device) {
+    if (conf.no_flicker) {
+        return 0;
+    }
+    if (update_current(device, 1) && cur.hz) {
+        set_source_power_line(src, cur.hz);
+    }
+    return !cur.detected;
+}
+
+/*
+ * After a capture from a frame source: if flicker was found in its frames, cache its frequency
+ * for device and location passed to set_source_flicker(), and set anti flicker accordingly, so that next frames are steady.
+ */
+void end_source_flicker(struct frame_source *src, const struct flicker_detector *d) {
+    const int hz = flicker_result(d);
+
+    if (hz == 0) {
+        return;
+    }
+    INFO("%dHz light flicker detected.\n", hz);
+    STREAM("flicker", "\"hz\":%d,\"detected\":1", hz);
+    store_cached(cur.key, hz);
+    cur.hz = hz;
+    cur.detected = 1;
+    set_source_power_line(src, hz);
+}
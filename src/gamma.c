@@ -1,11 +1,28 @@
 #include "../inc/gamma.h"
+#include "../inc/event.h"
+#include "../inc/stream.h"
+#include "../inc/pressure.h"
+#include "../inc/energy.h"
+#include "../inc/inhibit.h"
+#include "../inc/coroutine.h"
 
 #define ZENITH -0.83
 #define SMOOTH_TRANSITION_TIMEOUT 300 * 1000 * 1000
 #define EVENT_DURATION 30 * 60
+#define BUS_RETRY_TIMEOUT 60
+#define PRESSURE_RETRY_TIMEOUT 10
+#define NEUTRAL_TEMP 6500
+#define MIN_RETARGET_DIFF 200     // Kelvin
 
 static void gamma_cb(void);
+static void location_changed_cb(const struct event *ev);
+static void inhibit_changed_cb(const struct event *ev);
+static void ambient_temp_cb(const struct event *ev);
+static int get_target_temp(void);
 static void check_gamma(void);
+static void resume_transition(void);
+static int transition_co(struct coroutine *co);
+static void set_event_alarm(void);
 static double  degToRad(const double angleDeg);
 static double radToDeg(const double angleRad);
 static float to_hours(const float rad);
@@ -16,6 +33,14 @@ static void check_next_event(time_t *now);
 static void check_state(time_t *now);
 static int set_temp(int temp);
 
+static int paused;                  // whether a gamma transition is paused because screensaver is inhibited
+static int retarget;                // whether screen temperature must be updated because ambient temperature changed
+static int ambient_temp;            // last ambient light color temperature, 0 if unknown
+static int current_temp;            // last temperature set by us
+static int screen_temp;             // screen temperature during a transition, 0 if it must be read again
+static time_t deferred_since;       // when we started deferring a transition because of system pressure
+static struct coroutine transition; // transition towards target temperature
+
 void init_gamma(void) {
     if (!conf.no_gamma) {
         int initial_timeout = 0;
@@ -28,6 +53,24 @@ void init_gamma(void) {
         }
         int gamma_timerfd = start_timer(CLOCK_REALTIME, initial_timeout);
         init_module(gamma_timerfd, GAMMA_IX, gamma_cb, destroy_gamma);
+        subscribe_event(LOCATION_CHANGED, location_changed_cb);
+        subscribe_event(INHIBIT_CHANGED, inhibit_changed_cb);
+        if (conf.ambient_gamma_weight > 0) {
+            subscribe_event(AMBIENT_TEMP_MEASURED, ambient_temp_cb);
+        }
+    }
+}
+
+/*
+ * Restore a neutral screen temperature, without any smooth transition.
+ */
+void restore_gamma(void) {
+    if (modules[GAMMA_IX].inited) {
+        struct bus_args args = {"org.clightd.backlight", "/org/clightd/backlight", "org.clightd.backlight", "setgamma"};
+        int new_temp;
+        if (bus_call(&new_temp, "i", &args, "ssi", getenv("DISPLAY"), getenv("XAUTHORITY"), NEUTRAL_TEMP) == 0) {
+            INFO("Gamma temp restored to %d.\n", new_temp);
+        }
     }
 }
 
@@ -38,65 +81,153 @@ void destroy_gamma(void) {
 }
 
 static void gamma_cb(void) {
-    uint64_t t;
+    read_timer(main_p[GAMMA_IX].fd);
+    if (CO_RUNNING(&transition)) {
+        resume_transition();
+    } else {
+        check_gamma();
+    }
+}
+
+/*
+ * On new location, today's events are not valid anymore:
+ * reset them so that check_gamma will recompute them.
+ */
+static void location_changed_cb(const struct event *ev) {
+    if (modules[GAMMA_IX].inited) {
+        memset(state.events, 0, sizeof(state.events));
+        check_gamma();
+    }
+}
 
-    read(main_p[GAMMA_IX].fd, &t, sizeof(uint64_t));
-    check_gamma();
+/*
+ * Resume a paused transition as soon as screensaver is not inhibited anymore.
+ */
+static void inhibit_changed_cb(const struct event *ev) {
+    if (!ev->inhibited && paused) {
+        resume_transition();
+    }
+}
+
+/*
+ * Store new ambient light temperature; if it moves our target by more than MIN_RETARGET_DIFF, update screen temperature.
+ * A running transition reads its target at each step: it will just head to new one.
+ */
+static void ambient_temp_cb(const struct event *ev) {
+    INFO("Ambient color temperature: %dK.\n", ev->ambient_temp);
+    ambient_temp = ev->ambient_temp;
+    int target = get_target_temp();
+    if (target != -1 && current_temp && abs(target - current_temp) > MIN_RETARGET_DIFF && !CO_RUNNING(&transition)) {
+        retarget = 1;
+        check_gamma();
+    }
+}
+
+/*
+ * Screen temperature for current state, pulled towards ambient light temperature by conf.ambient_gamma_weight.
+ */
+static int get_target_temp(void) {
+    int temp = conf.temp[state.time];
+
+    if (temp != -1 && ambient_temp > 0) {
+        temp += conf.ambient_gamma_weight * (ambient_temp - temp);
+        temp = temp < 1000 ? 1000 : (temp > 10000 ? 10000 : temp);
+    }
+    return temp;
 }
 
 /*
  * checks next day events (or current day if clight has started right now).
- * Then, if needed (ie: first time this func is called or when state.time changed),
- * calls set_temp with correct temp, given current state(night or day).
- * It returns 0 if: smooth_transition is off or desired temp has finally been setted (after transitioning).
- * If it returns 0, reset transitioning flag and set next event timeout.
- * Else, set a timeout for smooth transition and set transitioning flag to 1.
- * If ret == 0, it can also mean we haven't called set_temp, and this means an
- * "event" timeout elapsed. If old_state != state.time (ie: if we entered or left EVENT state),
- * set new CAPTURE_IX correct timeout according to new state.
+ * Then, if needed (ie: first time this func is called, when state.time changed or on retarget),
+ * starts a transition towards correct temp, given current state(night or day).
+ * Once no transition is running, next event alarm is set.
+ * If old_state != state.time (ie: if we entered or left EVENT state), publish a STATE_CHANGED event.
+ * While a transition is running, gamma timer belongs to it: see transition_co().
  */
 static void check_gamma(void) {
-    static int transitioning = 0, first_time = 1;
-    time_t t;
+    static int first_time = 1;
+    time_t t = time(NULL);
     enum states old_state = state.time;
 
+    if (CO_RUNNING(&transition)) {
+        return;
+    }
+
     /*
-     * Only if we're not doing a smooth transition
+     * first time clight is started, get_gamma_events will poll today events.
+     * Then, it will be called every day after end of last event (ie: sunset + 30mins)
      */
-    if (!transitioning) {
-        t = time(NULL);
-        /*
-         * first time clight is started, get_gamma_events will poll today events.
-         * Then, it will be called every day after end of last event (ie: sunset + 30mins)
-         */
-        get_gamma_events(&t, conf.lat, conf.lon, state.events[SUNSET] != 0);
-        if (state.quit) {
-            return;
-        }
+    get_gamma_events(&t, conf.lat, conf.lon, state.events[SUNSET] != 0);
+    if (state.quit) {
+        return;
+    }
+
+    if (old_state != state.time) {
+        struct event ev = { .type = STATE_CHANGED, .state = { old_state, state.time } };
+        publish_event(&ev);
     }
 
-    int ret = 0;
-    if (transitioning || state.event_time_range == EVENT_DURATION || first_time) {
+    if (retarget || state.event_time_range == EVENT_DURATION || first_time) {
         first_time = 0;
-        ret = set_temp(conf.temp[state.time]); // ret = -1 if an error happens
+        retarget = 0;
+        return resume_transition();
     }
+    set_event_alarm();
+}
 
-    /* desired gamma temp has been setted. Set new GAMMA_IX timer and reset transitioning state. */
-    if (ret == 0) {
-        t = state.events[state.next_event] + state.event_time_range;
-        INFO("Next gamma alarm due to: %s", ctime(&t));
-        set_timeout(state.events[state.next_event] + state.event_time_range, 0, main_p[GAMMA_IX].fd, TFD_TIMER_ABSTIME);
-        transitioning = 0;
+/*
+ * Start or resume transition; once it is completed, gamma timer goes back to event alarms.
+ */
+static void resume_transition(void) {
+    if (transition_co(&transition) == CO_DONE) {
+        set_event_alarm();
+    }
+}
 
-        /* if we entered/left an event, set correct timeout to CAPTURE_IX */
-        if (old_state != state.time) {
-            set_timeout(conf.timeout[state.time], 0, main_p[CAPTURE_IX].fd, 0);
+/*
+ * Move screen temperature towards target, a step each SMOOTH_TRANSITION_TIMEOUT (see set_temp()).
+ * Target is read again at each step, so that a retarget only changes where transition is heading to.
+ * Transition is paused while screensaver is inhibited (inhibit_changed_cb resumes it),
+ * retried in BUS_RETRY_TIMEOUT seconds if clightd did not answer in time,
+ * and its steps are deferred while system is under pressure.
+ */
+static int transition_co(struct coroutine *co) {
+    int r;
+
+    CO_BEGIN(co);
+    screen_temp = 0;
+    for (;;) {
+        if (is_inhibited()) {
+            INFO("Screensaver is inhibited. Pausing gamma transition.\n");
+            paused = 1;
+            CO_AWAIT(co, !is_inhibited());
+            paused = 0;
+        }
+        energy_begin(GAMMA_ACTIVITY);
+        r = set_temp(get_target_temp());
+        energy_end(GAMMA_ACTIVITY);
+        if (r == 0) {
+            break;
+        }
+        if (r == 1) {
+            CO_SLEEP(co, main_p[GAMMA_IX].fd, 0, SMOOTH_TRANSITION_TIMEOUT);
+        } else {
+            CO_SLEEP(co, main_p[GAMMA_IX].fd, BUS_RETRY_TIMEOUT, 0);
+        }
+        /* Smooth transitions make lots of bus calls: defer them while system is under pressure */
+        while (defer_for_pressure(&deferred_since)) {
+            CO_SLEEP(co, main_p[GAMMA_IX].fd, PRESSURE_RETRY_TIMEOUT, 0);
         }
-    } else if (ret == 1) {
-        /* We are still in a gamma transition. Set a timeout of 300ms for smooth transition */
-        set_timeout(0, SMOOTH_TRANSITION_TIMEOUT, main_p[GAMMA_IX].fd, 0);
-        transitioning = 1;
     }
+    deferred_since = 0;
+    CO_END(co);
+}
+
+static void set_event_alarm(void) {
+    time_t t = state.events[state.next_event] + state.event_time_range;
+
+    INFO("Next gamma alarm due to: %s", ctime(&t));
+    set_timeout(t, 0, main_p[GAMMA_IX].fd, TFD_TIMER_ABSTIME);
 }
 
 /* Convert degrees to radians */
@@ -223,6 +354,28 @@ static int calculate_sunset(const float lat, const float lng, time_t *tt, int to
     return calculate_sunrise_sunset(lat, lng, tt, SUNSET, tomorrow);
 }
 
+/*
+ * Sun elevation (degrees) at time t in lat, lon location.
+ * Uses approximated solar declination and equation of time: error is within a degree,
+ * more than enough for our needs.
+ */
+double get_sun_elevation(time_t t, const double lat, const double lon) {
+    struct tm tm;
+
+    if (!gmtime_r(&t, &tm)) {
+        return 0.0;
+    }
+
+    const double b = 2 * M_PI * (tm.tm_yday + 1 - 81) / 364;
+    const double eq_time = 9.87 * sin(2 * b) - 7.53 * cos(b) - 1.5 * sin(b); // minutes
+    const double decl = 23.44 * sin(2 * M_PI * (284 + tm.tm_yday + 1) / 365);
+    const double solar_time = tm.tm_hour * 60 + tm.tm_min + tm.tm_sec / 60.0 + 4 * lon + eq_time;
+    const double hour_angle = solar_time / 4 - 180;
+
+    double sin_el = sin(degToRad(lat)) * sin(degToRad(decl)) + cos(degToRad(lat)) * cos(degToRad(decl)) * cos(degToRad(hour_angle));
+    return radToDeg(asin(sin_el));
+}
+
 /*
  * day -> will be 0 first time this func is called, else 1 (tomorrow).
  * Stores day sunrise/sunset events only if this is first time it is called,
@@ -313,52 +466,58 @@ static void check_state(time_t *now) {
 }
 
 /*
- * First, it gets current gamma value.
+ * First, it gets current gamma value, once per transition (screen_temp is reset when a transition starts).
  * Then, if current value is != from temp, it will adjust screen temperature accordingly.
  * If smooth_transition is enabled, the function will return 1 until they are the same.
- * old_temp is static so we don't have to call getgamma everytime the function is called (if smooth_transition is enabled.)
- * and gets resetted when old_temp reaches correct temp.
+ * getgamma and setgamma share a single bus time budget; -1 is returned if any of them fails.
  */
 static int set_temp(int temp) {
     const int step = 50;
     int new_temp;
-    static int old_temp = 0;
 
     if (temp == -1) {
         return 0;
     }
 
-    if (old_temp == 0) {
+    set_bus_deadline(2 * BUS_TIMEOUT);
+    if (screen_temp == 0) {
         struct bus_args args_get = {"org.clightd.backlight", "/org/clightd/backlight", "org.clightd.backlight", "getgamma"};
 
-        bus_call(&old_temp, "i", &args_get, "ss", getenv("DISPLAY"), getenv("XAUTHORITY"));
-        if (state.quit) {
+        if (bus_call(&screen_temp, "i", &args_get, "ss", getenv("DISPLAY"), getenv("XAUTHORITY")) < 0) {
+            screen_temp = 0;
+            reset_bus_deadline();
             return -1;
         }
     }
 
-    if (old_temp != temp) {
+    if (screen_temp != temp) {
         struct bus_args args_set = {"org.clightd.backlight", "/org/clightd/backlight", "org.clightd.backlight", "setgamma"};
+        int r;
 
         if (!conf.no_smooth_transition) {
-            if (old_temp > temp) {
-                    old_temp = old_temp - step < temp ? temp : old_temp - step;
+            if (screen_temp > temp) {
+                    screen_temp = screen_temp - step < temp ? temp : screen_temp - step;
                 } else {
-                    old_temp = old_temp + step > temp ? temp : old_temp + step;
+                    screen_temp = screen_temp + step > temp ? temp : screen_temp + step;
                 }
-                bus_call(&new_temp, "i", &args_set, "ssi", getenv("DISPLAY"), getenv("XAUTHORITY"), old_temp);
+                r = bus_call(&new_temp, "i", &args_set, "ssi", getenv("DISPLAY"), getenv("XAUTHORITY"), screen_temp);
         } else {
-            bus_call(&new_temp, "i", &args_set, "ssi", getenv("DISPLAY"), getenv("XAUTHORITY"), temp);
+            r = bus_call(&new_temp, "i", &args_set, "ssi", getenv("DISPLAY"), getenv("XAUTHORITY"), temp);
+        }
+        reset_bus_deadline();
+        if (r < 0) {
+            // we do not know current gamma value anymore: getgamma again next time
+            screen_temp = 0;
+            return -1;
         }
+        STREAM("gamma", "\"temp\":%d,\"target\":%d", new_temp, temp);
+        current_temp = new_temp;
         if (new_temp == temp) {
-            // reset old_temp for next call
-            old_temp = 0;
             INFO("%d gamma temp setted.\n", temp);
         }
     } else {
-        // reset old_temp
-        old_temp = 0;
-        new_temp = temp;
+        reset_bus_deadline();
+        new_temp = current_temp = temp;
         INFO("Gamma temp was already %d\n", temp);
     }
     return new_temp != temp;
@@ -0,0 +1,403 @@
+#include "../inc/hooks.h"
+#include "../inc/event.h"
+#include <spawn.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+
+#define HOOK_VALUE_MAX 64
+
+/* Sent by clight to helper: run command of hook id */
+struct hook_request {
+    int id;
+    int timeout;
+    char event[32];
+    char value[HOOK_VALUE_MAX];
+    char command[HOOK_CMD_MAX];
+};
+
+/* Sent by helper to clight: hook id has finished */
+struct hook_result {
+    int id;
+    int status;                     // wait status
+    int killed;                     // whether it got killed because of its timeout
+};
+
+/* Helper side: a running hook */
+struct hook_child {
+    pid_t pid;
+    int id;
+    time_t deadline;                // 0 if already killed
+    int killed;
+};
+
+/* Clight side: state of each configured hook */
+struct hook_state {
+    int running;
+    int pending;                    // whether an event arrived that still needs to be run
+    char value[HOOK_VALUE_MAX];     // value of latest event: pending runs are coalesced
+};
+
+static void helper_loop(int fd);
+static void close_inherited_fds(int fd);
+static void spawn_hook(int fd, const struct hook_request *req);
+static void reap_children(int fd);
+static void kill_expired(void);
+static int next_deadline(void);
+static void hooks_cb(void);
+static void hook_event_cb(const struct event *ev);
+static void format_value(const struct event *ev, char *value);
+static void start_pending(void);
+
+extern char **environ;
+
+static int helper_fd = -1;
+static struct hook_state hooks[MAX_HOOKS];
+static struct hook_child children[MAX_HOOKS];
+static int running;                 // number of hooks currently running
+static int next_hook;               // round robin start, so that a chatty hook cannot starve the others
+static const char *event_names[EVENT_TYPES_NUM] = {
+    "location", "state", "estimate", "dpms", "dimmer", "power", "inhibit", "ambient_temp"
+};
+static const char *states_dict[SIZE_STATES] = {"unknown", "day", "night", "event"};
+
+/*
+ * Fork hooks helper as soon as possible, before bus connection and modules are created:
+ * forking a small process is cheap, and it won't inherit anything it does not need.
+ * Helper will then posix_spawn each hook, enforce its timeout and reap it,
+ * so that clight main poll only ever exchanges small non-blocking messages with it.
+ */
+void fork_hooks_helper(void) {
+    int sv[2];
+
+    if (!conf.num_hooks) {
+        return;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        return WARN("%s\n", strerror(errno));
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        WARN("%s\n", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+    } else if (pid == 0) {
+        close(sv[0]);
+        helper_loop(sv[1]);
+        _exit(EXIT_SUCCESS);
+    } else {
+        close(sv[1]);
+        helper_fd = sv[0];
+    }
+}
+
+/*
+ * Helper main loop: spawn requested hooks, kill those whose timeout expired,
+ * and report finished ones back. It leaves as soon as clight closes its socket end.
+ */
+static void helper_loop(int fd) {
+    sigset_t mask;
+
+    close_inherited_fds(fd);
+    for (int i = 0; i < MAX_HOOKS; i++) {
+        children[i].pid = -1;
+    }
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+
+    struct pollfd p[2] = {
+        { .fd = fd, .events = POLLIN },
+        { .fd = sfd, .events = POLLIN }
+    };
+
+    for (;;) {
+        if (poll(p, 2, next_deadline()) == -1 && errno != EINTR) {
+            break;
+        }
+        if (p[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            if (read(sfd, &info, sizeof(info)) == sizeof(info)) {
+                reap_children(fd);
+            }
+        }
+        if (p[0].revents & (POLLIN | POLLHUP)) {
+            struct hook_request req;
+            ssize_t r = recv(fd, &req, sizeof(req), 0);
+            if (r <= 0) {
+                /* clight is leaving */
+                break;
+            }
+            if (r == sizeof(req)) {
+                spawn_hook(fd, &req);
+            }
+        }
+        kill_expired();
+    }
+
+    for (int i = 0; i < MAX_HOOKS; i++) {
+        if (children[i].pid != -1) {
+            kill(-children[i].pid, SIGTERM);
+        }
+    }
+}
+
+/*
+ * Log file and lock fd were opened before forking: do not keep them open.
+ */
+static void close_inherited_fds(int fd) {
+    DIR *d = opendir("/proc/self/fd");
+    if (!d) {
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(d))) {
+        int i = atoi(entry->d_name);
+        if (i > STDERR_FILENO && i != fd && i != dirfd(d)) {
+            close(i);
+        }
+    }
+    closedir(d);
+}
+
+/*
+ * Run hook command through sh, with CLIGHT_EVENT and CLIGHT_VALUE env variables.
+ * Hook gets its own process group, so that its whole tree gets killed on timeout.
+ */
+static void spawn_hook(int fd, const struct hook_request *req) {
+    int slot = -1;
+    for (int i = 0; i < MAX_HOOKS && slot == -1; i++) {
+        if (children[i].pid == -1) {
+            slot = i;
+        }
+    }
+
+    int n = 0;
+    while (environ[n]) {
+        n++;
+    }
+    char **envp = calloc(n + 3, sizeof(char *));
+    char event[64], value[HOOK_VALUE_MAX + 16];
+    struct hook_result res = { .id = req->id, .status = -1 };
+    if (!envp || slot == -1) {
+        free(envp);
+        send(fd, &res, sizeof(res), MSG_NOSIGNAL);
+        return;
+    }
+    memcpy(envp, environ, n * sizeof(char *));
+    snprintf(event, sizeof(event), "CLIGHT_EVENT=%s", req->event);
+    snprintf(value, sizeof(value), "CLIGHT_VALUE=%s", req->value);
+    envp[n] = event;
+    envp[n + 1] = value;
+
+    posix_spawnattr_t attr;
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setsigmask(&attr, &mask);
+
+    char *argv[] = { "sh", "-c", (char *)req->command, NULL };
+    pid_t pid;
+    if (posix_spawn(&pid, "/bin/sh", NULL, &attr, argv, envp) == 0) {
+        children[slot].pid = pid;
+        children[slot].id = req->id;
+        children[slot].deadline = get_monotonic_time() + req->timeout;
+        children[slot].killed = 0;
+    } else {
+        send(fd, &res, sizeof(res), MSG_NOSIGNAL);
+    }
+    posix_spawnattr_destroy(&attr);
+    free(envp);
+}
+
+static void reap_children(int fd) {
+    pid_t pid;
+    int status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < MAX_HOOKS; i++) {
+            if (children[i].pid == pid) {
+                struct hook_result res = { .id = children[i].id, .status = status, .killed = children[i].killed };
+                send(fd, &res, sizeof(res), MSG_NOSIGNAL);
+                children[i].pid = -1;
+                break;
+            }
+        }
+    }
+}
+
+static void kill_expired(void) {
+    time_t now = get_monotonic_time();
+
+    for (int i = 0; i < MAX_HOOKS; i++) {
+        if (children[i].pid != -1 && children[i].deadline && children[i].deadline <= now) {
+            kill(-children[i].pid, SIGKILL);
+            children[i].deadline = 0;
+            children[i].killed = 1;
+        }
+    }
+}
+
+/*
+ * Poll timeout (in ms) until nearest hook deadline; -1 if no hook is running.
+ */
+static int next_deadline(void) {
+    time_t now = get_monotonic_time();
+    int timeout = -1;
+
+    for (int i = 0; i < MAX_HOOKS; i++) {
+        if (children[i].pid != -1 && children[i].deadline) {
+            int t = children[i].deadline > now ? (children[i].deadline - now) * 1000 : 0;
+            if (timeout == -1 || t < timeout) {
+                timeout = t;
+            }
+        }
+    }
+    return timeout;
+}
+
+/*
+ * Clight side: subscribe to every event any hook is interested in,
+ * and poll helper socket to know when hooks finish.
+ */
+void init_hooks(void) {
+    if (!conf.num_hooks) {
+        return;
+    }
+
+    int fd = helper_fd;
+    if (fd == -1) {
+        /* hooks are not needed by clight to work: do not leave on error */
+        WARN("Hooks helper not available. Hooks disabled.\n");
+        fd = DONT_POLL_W_ERR;
+    } else {
+        for (int i = 0; i < EVENT_TYPES_NUM; i++) {
+            for (int j = 0; j < conf.num_hooks; j++) {
+                if (!strcmp(conf.hooks[j].event, event_names[i])) {
+                    subscribe_event(i, hook_event_cb);
+                    break;
+                }
+            }
+        }
+    }
+    init_module(fd, HOOKS_IX, hooks_cb, destroy_hooks);
+}
+
+static void hooks_cb(void) {
+    struct hook_result res;
+    ssize_t r;
+
+    while ((r = recv(helper_fd, &res, sizeof(res), MSG_DONTWAIT)) == sizeof(res)) {
+        if (res.id >= 0 && res.id < conf.num_hooks && hooks[res.id].running) {
+            const char *event = conf.hooks[res.id].event;
+            if (res.killed) {
+                WARN("Hook for %s killed after %ds.\n", event, conf.hooks[res.id].timeout);
+            } else if (!WIFEXITED(res.status) || WEXITSTATUS(res.status)) {
+                WARN("Hook for %s failed.\n", event);
+            } else {
+                INFO("Hook for %s completed.\n", event);
+            }
+            hooks[res.id].running = 0;
+            running--;
+        }
+    }
+    if (r == 0 || (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        WARN("Hooks helper left. Hooks disabled.\n");
+        close(helper_fd);
+        helper_fd = -1;
+        main_p[HOOKS_IX].fd = -1;
+        return;
+    }
+    start_pending();
+}
+
+/*
+ * Mark every hook interested in this event as pending.
+ * If a hook was already pending, its runs get coalesced into a single one, with latest value.
+ */
+static void hook_event_cb(const struct event *ev) {
+    char value[HOOK_VALUE_MAX];
+
+    format_value(ev, value);
+    for (int i = 0; i < conf.num_hooks; i++) {
+        if (!strcmp(conf.hooks[i].event, event_names[ev->type])) {
+            strncpy(hooks[i].value, value, sizeof(hooks[i].value) - 1);
+            hooks[i].pending = 1;
+        }
+    }
+    start_pending();
+}
+
+static void format_value(const struct event *ev, char *value) {
+    switch (ev->type) {
+        case LOCATION_CHANGED:
+            snprintf(value, HOOK_VALUE_MAX, "%.2lf,%.2lf", ev->location.lat, ev->location.lon);
+            break;
+        case STATE_CHANGED:
+            snprintf(value, HOOK_VALUE_MAX, "%s", states_dict[ev->state.current]);
+            break;
+        case AMBIENT_MEASURED:
+            snprintf(value, HOOK_VALUE_MAX, "%lf", ev->ambient);
+            break;
+        case DISPLAY_POWER_CHANGED:
+            snprintf(value, HOOK_VALUE_MAX, "%d", ev->dpms);
+            break;
+        case DIMMED_CHANGED:
+            snprintf(value, HOOK_VALUE_MAX, "%d", ev->dimmed);
+            break;
+        case POWER_SOURCE_CHANGED:
+            snprintf(value, HOOK_VALUE_MAX, "%s", ev->on_battery ? "battery" : "ac");
+            break;
+        case INHIBIT_CHANGED:
+            snprintf(value, HOOK_VALUE_MAX, "%d", ev->inhibited);
+            break;
+        case AMBIENT_TEMP_MEASURED:
+            snprintf(value, HOOK_VALUE_MAX, "%d", ev->ambient_temp);
+            break;
+        default:
+            value[0] = '\0';
+            break;
+    }
+}
+
+/*
+ * Start pending hooks, up to conf.hooks_concurrency running at same time.
+ * A hook is never run twice concurrently: if still running, it'll be started again once finished.
+ */
+static void start_pending(void) {
+    for (int n = 0; n < conf.num_hooks && running < conf.hooks_concurrency && helper_fd != -1; n++) {
+        int i = (next_hook + n) % conf.num_hooks;
+        if (!hooks[i].pending || hooks[i].running) {
+            continue;
+        }
+
+        struct hook_request req = { .id = i, .timeout = conf.hooks[i].timeout };
+        strncpy(req.event, conf.hooks[i].event, sizeof(req.event) - 1);
+        strncpy(req.value, hooks[i].value, sizeof(req.value) - 1);
+        strncpy(req.command, conf.hooks[i].command, sizeof(req.command) - 1);
+        if (send(helper_fd, &req, sizeof(req), MSG_DONTWAIT | MSG_NOSIGNAL) != sizeof(req)) {
+            /* helper is busy: retry when next hook finishes */
+            break;
+        }
+        hooks[i].pending = 0;
+        hooks[i].running = 1;
+        running++;
+        next_hook = (i + 1) % conf.num_hooks;
+    }
+}
+
+void destroy_hooks(void) {
+    /* helper will terminate any hook still running */
+    if (helper_fd != -1) {
+        close(helper_fd);
+    }
+}
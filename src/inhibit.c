@@ -0,0 +1,203 @@
+#include "../inc/inhibit.h"
+#include "../inc/event.h"
+#include "../inc/stream.h"
+
+#define MAX_INHIBITORS 32
+
+static void inhibit_cb(void);
+static int method_inhibit(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int method_uninhibit(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int name_owner_changed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static void remove_inhibitor(int i);
+static void publish_inhibited(int inhibited);
+
+/*
+ * An active Inhibit call: its cookie, unique bus name of caller, application name,
+ * and match on its caller leaving the bus.
+ */
+struct inhibitor {
+    uint32_t cookie;
+    char owner[64];
+    char app[64];
+    sd_bus_slot *slot;
+};
+
+static const sd_bus_vtable vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_METHOD("Inhibit", "ss", "u", method_inhibit, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("UnInhibit", "u", "", method_uninhibit, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_VTABLE_END
+};
+
+static sd_bus *userbus;
+static struct inhibitor inhibitors[MAX_INHIBITORS];
+static int num_inhibitors;
+static uint32_t last_cookie;
+
+/*
+ * Provide org.freedesktop.ScreenSaver Inhibit/UnInhibit methods on session bus
+ * (on both /org/freedesktop/ScreenSaver and /ScreenSaver paths, as applications use both),
+ * so that video players and presentation tools can tell us to pause.
+ * If name is already owned (ie: by desktop environment), just disable this module.
+ * As we own the name, nobody else will keep screen on for callers: dpms module holds off
+ * DPMS and X screensaver while we are inhibited.
+ * Callers that leave the bus without calling UnInhibit are cleaned up on NameOwnerChanged:
+ * a match is only added for each caller, so that other bus names changes do not wake us up.
+ */
+void init_inhibit(void) {
+    int fd = DONT_POLL_W_ERR;
+
+    if (conf.no_inhibit) {
+        return;
+    }
+
+    int r = sd_bus_open_user(&userbus);
+    if (r < 0) {
+        WARN("Failed to connect to user bus: %s\n", strerror(-r));
+        goto end;
+    }
+
+    if (sd_bus_add_object_vtable(userbus, NULL, "/org/freedesktop/ScreenSaver", "org.freedesktop.ScreenSaver", vtable, NULL) < 0
+        || sd_bus_add_object_vtable(userbus, NULL, "/ScreenSaver", "org.freedesktop.ScreenSaver", vtable, NULL) < 0) {
+        WARN("Failed to add org.freedesktop.ScreenSaver object.\n");
+        goto end;
+    }
+
+    r = sd_bus_request_name(userbus, "org.freedesktop.ScreenSaver", 0);
+    if (r < 0) {
+        WARN("Failed to acquire org.freedesktop.ScreenSaver name: %s\n", strerror(-r));
+        goto end;
+    }
+
+    fd = sd_bus_get_fd(userbus);
+
+end:
+    /* inhibit support is not needed by clight to work: do not leave on error */
+    if (fd == DONT_POLL_W_ERR && userbus) {
+        userbus = sd_bus_flush_close_unref(userbus);
+    }
+    init_module(fd, INHIBIT_IX, inhibit_cb, destroy_inhibit);
+}
+
+static void inhibit_cb(void) {
+    int r;
+
+    do {
+        r = sd_bus_process(userbus, NULL);
+    } while (r > 0);
+}
+
+/*
+ * Match is added asynchronously: we are inside a method call, do not wait for bus daemon.
+ * Its userdata is inhibitor cookie, as inhibitors move inside our array.
+ */
+static int method_inhibit(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    const char *app, *reason;
+    char match[256];
+
+    int r = sd_bus_message_read(m, "ss", &app, &reason);
+    if (r < 0) {
+        return r;
+    }
+
+    const char *sender = sd_bus_message_get_sender(m);
+    if (!sender) {
+        return sd_bus_error_set_const(ret_error, SD_BUS_ERROR_INVALID_ARGS, "Unknown caller.");
+    }
+
+    if (num_inhibitors == MAX_INHIBITORS) {
+        return sd_bus_error_set_const(ret_error, SD_BUS_ERROR_LIMITS_EXCEEDED, "Too many inhibitors.");
+    }
+
+    struct inhibitor *i = &inhibitors[num_inhibitors];
+    memset(i, 0, sizeof(struct inhibitor));
+    /* 0 is not a valid cookie */
+    if (++last_cookie == 0) {
+        last_cookie++;
+    }
+    i->cookie = last_cookie;
+    strncpy(i->owner, sender, sizeof(i->owner) - 1);
+    strncpy(i->app, app, sizeof(i->app) - 1);
+    snprintf(match, sizeof(match), "type='signal',sender='org.freedesktop.DBus',interface='org.freedesktop.DBus',"
+             "member='NameOwnerChanged',arg0='%s'", i->owner);
+    r = sd_bus_add_match_async(userbus, &i->slot, match, name_owner_changed, NULL, (void *)(uintptr_t)i->cookie);
+    if (r < 0) {
+        return r;
+    }
+    num_inhibitors++;
+    INFO("Screensaver inhibited by %s: %s.\n", app, reason);
+    if (num_inhibitors == 1) {
+        publish_inhibited(1);
+    }
+    return sd_bus_reply_method_return(m, "u", i->cookie);
+}
+
+static int method_uninhibit(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    uint32_t cookie;
+
+    int r = sd_bus_message_read(m, "u", &cookie);
+    if (r < 0) {
+        return r;
+    }
+
+    for (int i = 0; i < num_inhibitors; i++) {
+        if (inhibitors[i].cookie == cookie) {
+            remove_inhibitor(i);
+            break;
+        }
+    }
+    return sd_bus_reply_method_return(m, "");
+}
+
+/*
+ * Caller of an inhibitor (whose cookie is userdata) left the bus without calling UnInhibit: drop it.
+ * Each of its inhibitors has its own match, so each one gets dropped by its own signal.
+ */
+static int name_owner_changed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    const char *name, *old_owner, *new_owner;
+    const uint32_t cookie = (uint32_t)(uintptr_t)userdata;
+
+    if (sd_bus_message_read(m, "sss", &name, &old_owner, &new_owner) >= 0 && !strlen(new_owner)) {
+        for (int i = 0; i < num_inhibitors; i++) {
+            if (inhibitors[i].cookie == cookie) {
+                remove_inhibitor(i);
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+static void remove_inhibitor(int i) {
+    INFO("Screensaver uninhibited by %s.\n", inhibitors[i].app);
+    sd_bus_slot_unref(inhibitors[i].slot);
+    inhibitors[i] = inhibitors[--num_inhibitors];
+    if (num_inhibitors == 0) {
+        publish_inhibited(0);
+    }
+}
+
+static void publish_inhibited(int inhibited) {
+    struct event ev = { .type = INHIBIT_CHANGED, .inhibited = inhibited };
+    publish_event(&ev);
+}
+
+/*
+ * Whether captures, dimming and gamma transitions should be paused.
+ */
+int is_inhibited(void) {
+    return num_inhibitors > 0;
+}
+
+/*
+ * Our name and matches are released together with our connection.
+ */
+void destroy_inhibit(void) {
+    for (int i = 0; i < num_inhibitors; i++) {
+        sd_bus_slot_unref(inhibitors[i].slot);
+    }
+    if (userbus) {
+        sd_bus_close(userbus);
+        sd_bus_unref(userbus);
+    }
+}
@@ -1,29 +1,43 @@
 #include "../inc/location.h"
+#include "../inc/event.h"
+#include "../inc/cities.h"
+#include "../inc/stats.h"
 
 #include <sys/eventfd.h>
+#include <sys/epoll.h>
 #include <fcntl.h>
 
+#define GOOD_FIX_ACCURACY 50000     // meters: we do not need more precision for sunrise/sunset computations
+#define REFRESH_TIMEOUT 12 * 60 * 60 // seconds after which a stopped geoclue2 client is restarted
+#define NM_STATE_CONNECTED_GLOBAL 70
+
 static int location_conf_init(void);
 static int geoclue_init(void);
 static void location_cb(void);
+static void new_location_available(void);
 static void geoclue_check_initial_location(void);
 static int is_geoclue(void);
-static void geoclue_get_client(void);
+static int geoclue_get_client(void);
 static void geoclue_hook_update(void);
 static int geoclue_new_location(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
-static void geoclue_client_start(void);
+static int network_changed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int geoclue_init_fd(void);
+static void geoclue_client_setup(void);
+static int geoclue_client_start(void);
 static void geoclue_client_stop(void);
 
 static char client[PATH_MAX + 1];
+static int running;                 // whether geoclue2 client is running
+static int refresh_fd = -1;         // timerfd to restart geoclue2 client after REFRESH_TIMEOUT
 
 /*
  * init location:
- * if lat and lon are passed as program cmdline args,
+ * if lat and lon are passed as program cmdline args (or found through conf.city),
  * creates an eventfd and writes in it to let main poll
  * know that location is available thus gamma is ready to be set.
  *
- * Else, init geoclue support and returns sd_bus_get_fd to
- * let main_poll listen on new events from sd_bus.
+ * Else, init geoclue support and returns an epoll fd to let main_poll listen
+ * on both new events from sd_bus and geoclue2 client refresh timer.
  * Finally, checks if a location is already available through GeoClue2.
  *
  * Moreover, it stores a callback to be called on updated location event.
@@ -37,6 +51,9 @@ void init_location(void) {
     if (!conf.no_gamma && (!strlen(conf.events[SUNRISE]) || !strlen(conf.events[SUNSET]))) {
         int fd;
         
+        if (conf.lat == 0 && conf.lon == 0 && strlen(conf.city) && find_city(conf.city, &conf.lat, &conf.lon) == -1) {
+            WARN("City %s not found.\n", conf.city);
+        }
         if (conf.lat != 0 && conf.lon != 0) {
             fd = location_conf_init();
         } else {
@@ -70,29 +87,37 @@ static int location_conf_init(void) {
  * Init geoclue, then process any old bus requests.
  * Checks if a location is already available and
  * finally returns sd_bus_get_fd to let main poll catch bus events.
+ * Whole sequence shares a single bus time budget: GetClient may need
+ * to activate geoclue2 service, so it is given a longer one.
+ * To minimize geoclue2 traffic, only city level accuracy is requested,
+ * and client gets stopped as soon as a good enough location is received.
+ * It will be restarted after REFRESH_TIMEOUT, or when network connectivity changes.
  */
 static int geoclue_init(void) {
     int location_fd = -1;
+    int r;
 
-    geoclue_get_client();
-    if (state.quit) {
+    set_bus_deadline(3 * BUS_TIMEOUT);
+    if (geoclue_get_client() < 0 || state.quit) {
         goto end;
     }
     geoclue_hook_update();
     if (state.quit) {
         goto end;
     }
-    geoclue_client_start();
-    if (state.quit) {
+    geoclue_client_setup();
+    if (geoclue_client_start() < 0 || state.quit) {
         goto end;
     }
     // let main poll listen on new position events coming from geoclue
-    location_fd = sd_bus_get_fd(bus);
+    location_fd = geoclue_init_fd();
+    if (location_fd == -1) {
+        goto end;
+    }
 
     /* Process old requests -> otherwise our fd would get useless/wrong data */
-    int r;
     do {
-        r = sd_bus_process(bus, NULL);
+        r = bus_process();
     } while (r > 0);
 
     // emit a bus signal if there already is a location
@@ -100,8 +125,9 @@ static int geoclue_init(void) {
     geoclue_check_initial_location();
 
 end:
+    reset_bus_deadline();
     /* In case of geoclue2 error, do not leave. Just disable gamma support as geoclue2 is an opt-dep. */
-    if (state.quit) {
+    if (location_fd < 0 || state.quit) {
         WARN("Error while loading geoclue2 support. Gamma correction tool disabled.\n");
         conf.no_gamma = 1; // disable gamma
         location_fd = DONT_POLL_W_ERR; // do not poll this fd because an error happened
@@ -110,23 +136,67 @@ end:
 }
 
 /*
- * When a new location is received, reset GAMMA timer to now + 1sec;
- * this way, check_gamma will be called and it will correctly set new timer.
+ * If geoclue2 is not being used, we received our position through eventfd.
+ * Else, process every queued bus message: geoclue_new_location will be called
+ * for LocationUpdated signals.
  */
 static void location_cb(void) {
-    int r;
-    /* we received a new user position */
     if (!is_geoclue()) {
-        uint64_t t;
         /* it is not from a bus signal as geoclue2 is not being used */
-        r = read(main_p[LOCATION_IX].fd, &t, sizeof(uint64_t));
+        if (read_timer(main_p[LOCATION_IX].fd) != -1) {
+            new_location_available();
+        }
     } else {
-        r = sd_bus_process(bus, NULL);
+        struct epoll_event evs[2];
+        COUNT(POLL_CNT);
+        int r = epoll_wait(main_p[LOCATION_IX].fd, evs, 2, 0);
+        for (int i = 0; i < r; i++) {
+            if (evs[i].data.fd == refresh_fd) {
+                read_timer(refresh_fd);
+                if (!running) {
+                    INFO("Refreshing location.\n");
+                    geoclue_client_start();
+                }
+            }
+        }
+
+        do {
+            r = bus_process();
+        } while (r > 0);
     }
-    if (r >= 0) {
-        INFO("New location received: %.2lf, %.2lf\n", conf.lat, conf.lon);
-        set_timeout(1, 0, main_p[GAMMA_IX].fd, 0);
+}
+
+/*
+ * Create an epoll fd listening on bus fd and on a timerfd used to restart geoclue2 client.
+ */
+static int geoclue_init_fd(void) {
+    int fd = epoll_create1(EPOLL_CLOEXEC);
+    if (fd == -1) {
+        WARN("%s\n", strerror(errno));
+        return -1;
     }
+
+    refresh_fd = start_timer(CLOCK_BOOTTIME, 0);
+    struct epoll_event bus_ev = { .events = EPOLLIN, .data.fd = sd_bus_get_fd(bus) };
+    struct epoll_event timer_ev = { .events = EPOLLIN, .data.fd = refresh_fd };
+    if (refresh_fd == -1 || epoll_ctl(fd, EPOLL_CTL_ADD, bus_ev.data.fd, &bus_ev) == -1
+        || epoll_ctl(fd, EPOLL_CTL_ADD, refresh_fd, &timer_ev) == -1) {
+        WARN("%s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * When a new location is received, publish a LOCATION_CHANGED event.
+ * Note that LocationUpdated signal may be dispatched while we are waiting
+ * for any other bus call reply, thus this is not called from location_cb.
+ */
+static void new_location_available(void) {
+    INFO("New location received: %.2lf, %.2lf\n", conf.lat, conf.lon);
+    struct event ev = { .type = LOCATION_CHANGED, .location = { conf.lat, conf.lon } };
+    publish_event(&ev);
 }
 
 /*
@@ -147,12 +217,20 @@ static void geoclue_check_initial_location(void) {
 }
 
 /*
- * If we are using geoclue, stop client.
+ * If we are using geoclue, stop client (if it is still running).
+ * As we're leaving, Stop call is fired without waiting for its reply.
  */
 void destroy_location(void) {
     if (is_geoclue()) {
-        geoclue_client_stop();
-    } else if (main_p[LOCATION_IX].fd > 0) {
+        if (running) {
+            struct bus_args args = {"org.freedesktop.GeoClue2", client, "org.freedesktop.GeoClue2.Client", "Stop"};
+            bus_send(&args);
+        }
+        if (refresh_fd != -1) {
+            close(refresh_fd);
+        }
+    }
+    if (main_p[LOCATION_IX].fd > 0) {
         close(main_p[LOCATION_IX].fd);
     }
 }
@@ -167,13 +245,14 @@ static int is_geoclue(void) {
 /*
  * Store Client object path in client (static) global var
  */
-static void geoclue_get_client(void) {
-    struct bus_args args = {"org.freedesktop.GeoClue2", "/org/freedesktop/GeoClue2/Manager", "org.freedesktop.GeoClue2.Manager", "GetClient"};
-    bus_call(client, "o", &args, "");
+static int geoclue_get_client(void) {
+    struct bus_args args = {"org.freedesktop.GeoClue2", "/org/freedesktop/GeoClue2/Manager", "org.freedesktop.GeoClue2.Manager", "GetClient", 2 * BUS_TIMEOUT};
+    return bus_call(client, "o", &args, "");
 }
 
 /*
  * Hook our geoclue_new_location callback to PropertiesChanged dbus signals on GeoClue2 service.
+ * Moreover, hook network_changed to NetworkManager StateChanged signals.
  */
 static void geoclue_hook_update(void) {
     struct bus_args args = {
@@ -181,37 +260,81 @@ static void geoclue_hook_update(void) {
         .interface = "org.freedesktop.GeoClue2.Client",
         .member = "LocationUpdated"
     };
+    struct bus_args nm_args = {
+        .path = "/org/freedesktop/NetworkManager",
+        .interface = "org.freedesktop.NetworkManager",
+        .member = "StateChanged"
+    };
     add_match(&args, geoclue_new_location);
+    add_match(&nm_args, network_changed);
 }
 
 /*
  * On new location callback: retrieve new_location object,
  * then retrieve latitude and longitude from that object and store them in our conf struct.
+ * If location is accurate enough, stop geoclue2 client until REFRESH_TIMEOUT.
  */
 static int geoclue_new_location(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
     const char *new_location, *old_location;
+    double accuracy = GOOD_FIX_ACCURACY + 1;
 
     sd_bus_message_read(m, "oo", &old_location, &new_location);
 
     struct bus_args lat_args = {"org.freedesktop.GeoClue2", new_location, "org.freedesktop.GeoClue2.Location", "Latitude"};
     struct bus_args lon_args = {"org.freedesktop.GeoClue2", new_location, "org.freedesktop.GeoClue2.Location", "Longitude"};
+    struct bus_args acc_args = {"org.freedesktop.GeoClue2", new_location, "org.freedesktop.GeoClue2.Location", "Accuracy"};
 
-    get_property(&lat_args, "d", &conf.lat);
-    get_property(&lon_args, "d", &conf.lon);
+    if (get_property(&lat_args, "d", &conf.lat) == 0 && get_property(&lon_args, "d", &conf.lon) == 0) {
+        new_location_available();
+        get_property(&acc_args, "d", &accuracy);
+        if (running && accuracy <= GOOD_FIX_ACCURACY) {
+            INFO("Location accuracy: %.0lfm. Stopping geoclue2 client.\n", accuracy);
+            geoclue_client_stop();
+            set_timeout(REFRESH_TIMEOUT, 0, refresh_fd, 0);
+        }
+    }
     return 0;
 }
 
 /*
- * Start our geoclue2 client after having correctly set needed properties.
+ * When network connectivity is back, we may have moved: restart geoclue2 client.
  */
-static void geoclue_client_start(void) {
-    struct bus_args call_args = {"org.freedesktop.GeoClue2", client, "org.freedesktop.GeoClue2.Client", "Start"};
+static int network_changed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    uint32_t nm_state;
+
+    if (sd_bus_message_read(m, "u", &nm_state) >= 0 && nm_state == NM_STATE_CONNECTED_GLOBAL && !running) {
+        INFO("Network connectivity changed. Refreshing location.\n");
+        geoclue_client_start();
+    }
+    return 0;
+}
+
+/*
+ * Set needed geoclue2 client properties:
+ * we only need city level accuracy (GCLUE_ACCURACY_LEVEL_CITY),
+ * and we do not need updates more frequent than 10mins or nearer than 50kms.
+ */
+static void geoclue_client_setup(void) {
     struct bus_args id_args = {"org.freedesktop.GeoClue2", client, "org.freedesktop.GeoClue2.Client", "DesktopId"};
     struct bus_args thres_args = {"org.freedesktop.GeoClue2", client, "org.freedesktop.GeoClue2.Client", "DistanceThreshold"};
+    struct bus_args time_args = {"org.freedesktop.GeoClue2", client, "org.freedesktop.GeoClue2.Client", "TimeThreshold"};
+    struct bus_args acc_args = {"org.freedesktop.GeoClue2", client, "org.freedesktop.GeoClue2.Client", "RequestedAccuracyLevel"};
 
     set_property(&id_args, 's', "clight");
     set_property(&thres_args, 'u', "50000"); // 50kms
-    bus_call(NULL, "", &call_args, "");
+    set_property(&time_args, 'u', "600"); // 10mins
+    set_property(&acc_args, 'u', "4"); // GCLUE_ACCURACY_LEVEL_CITY
+}
+
+/*
+ * Start our geoclue2 client.
+ */
+static int geoclue_client_start(void) {
+    struct bus_args call_args = {"org.freedesktop.GeoClue2", client, "org.freedesktop.GeoClue2.Client", "Start"};
+
+    int r = bus_call(NULL, "", &call_args, "");
+    running = r == 0;
+    return r;
 }
 
 /*
@@ -219,5 +342,8 @@ static void geoclue_client_start(void) {
  */
 static void geoclue_client_stop(void) {
     struct bus_args args = {"org.freedesktop.GeoClue2", client, "org.freedesktop.GeoClue2.Client", "Stop"};
-    bus_call(NULL, "", &args, "");
+
+    if (bus_call(NULL, "", &args, "") == 0) {
+        running = 0;
+    }
 }
@@ -33,9 +33,38 @@ void log_conf(void) {
         fprintf(log_file, "* Smooth transitions: %s\n", conf.no_smooth_transition ? "disabled" : "enabled");
         fprintf(log_file, "* Latitude: %.2lf\n", conf.lat);
         fprintf(log_file, "* Longitude: %.2lf\n", conf.lon);
+        fprintf(log_file, "* City: %s\n", conf.city);
         fprintf(log_file, "* User setted sunrise: %s\n", conf.events[SUNRISE]);
         fprintf(log_file, "* User setted sunset: %s\n", conf.events[SUNSET]);
-        fprintf(log_file, "* Gamma correction: %s\n\n", conf.no_gamma ? "disabled" : "enabled");
+        fprintf(log_file, "* Gamma correction: %s\n", conf.no_gamma ? "disabled" : "enabled");
+        fprintf(log_file, "* Fast recapture drop limit: %.2lf\n", conf.drop_limit);
+        fprintf(log_file, "* Pressure awareness: %s\n", conf.no_pressure ? "disabled" : "enabled");
+        fprintf(log_file, "* Pressure threshold: %d%%\n", conf.pressure_threshold);
+        fprintf(log_file, "* Max pressure deferral: %d\n", conf.max_pressure_deferral);
+        fprintf(log_file, "* Dead reckoning: %s\n", conf.no_dead_reckoning ? "disabled" : "enabled");
+        fprintf(log_file, "* Dimmer: %s\n", conf.no_dimmer ? "disabled" : "enabled");
+        fprintf(log_file, "* Dimmer timeout: %d\n", conf.dimmer_timeout);
+        fprintf(log_file, "* Dimmer backlight level: %.2lf\n", conf.dimmer_pct);
+        fprintf(log_file, "* Ambient gamma weight: %.2lf\n", conf.ambient_gamma_weight);
+        fprintf(log_file, "* Capture freshness: %d\n", conf.capture_freshness);
+        fprintf(log_file, "* Inhibit support: %s\n", conf.no_inhibit ? "disabled" : "enabled");
+        fprintf(log_file, "* Dpms timeouts management: %s\n", conf.manage_dpms ? "enabled" : "disabled");
+        fprintf(log_file, "* AC dpms timeouts: %d, %d, %d\n", conf.dpms_timeouts[ON_AC][DAY], conf.dpms_timeouts[ON_AC][NIGHT], conf.dpms_timeouts[ON_AC][EVENT]);
+        fprintf(log_file, "* Battery dpms timeouts: %d, %d, %d\n", conf.dpms_timeouts[ON_BATTERY][DAY], conf.dpms_timeouts[ON_BATTERY][NIGHT], conf.dpms_timeouts[ON_BATTERY][EVENT]);
+        fprintf(log_file, "* Hooks: %d\n", conf.num_hooks);
+        fprintf(log_file, "* Hooks concurrency: %d\n", conf.hooks_concurrency);
+        fprintf(log_file, "* Restore on exit: %s\n", conf.restore_on_exit ? "enabled" : "disabled");
+        if (conf.roi[2] > 0) {
+            fprintf(log_file, "* Webcam roi: %.2lf, %.2lf, %.2lf, %.2lf\n", conf.roi[0], conf.roi[1], conf.roi[2], conf.roi[3]);
+        }
+        for (int i = 0; i < conf.num_rois; i++) {
+            fprintf(log_file, "* %s roi: %.2lf, %.2lf, %.2lf, %.2lf\n", conf.rois[i].device,
+                    conf.rois[i].roi[0], conf.rois[i].roi[1], conf.rois[i].roi[2], conf.rois[i].roi[3]);
+        }
+        fprintf(log_file, "* Frame source: %s\n", strlen(conf.frame_source) ? conf.frame_source : "webcam");
+        fprintf(log_file, "* Anti flicker: %s\n", conf.no_flicker ? "disabled" : "enabled");
+        fprintf(log_file, "* Budget file: %s\n", conf.budget_file);
+        fprintf(log_file, "* Trace file: %s\n\n", conf.trace_file);
     }
 }
 
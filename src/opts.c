@@ -2,6 +2,14 @@
 #include <popt.h>
 
 static void parse_cmd(int argc, char *const argv[]);
+static void parse_dpms_timeouts(const char *str, int *timeouts);
+static void check_roi(double *roi);
+
+/* default dpms timeouts for each power source and state: shorter at night and on battery */
+static const int default_dpms_timeouts[SIZE_AC][SIZE_STATES] = {
+    { 15 * 60, 15 * 60, 5 * 60, 10 * 60 },
+    { 5 * 60, 5 * 60, 2 * 60, 3 * 60 }
+};
 
 /*
  * Init default config values,
@@ -20,6 +28,14 @@ void init_opts(int argc, char *argv[]) {
     conf.temp[NIGHT] = 4000;
     conf.temp[EVENT] = -1;
     conf.temp[UNKNOWN] = conf.temp[DAY];
+    conf.drop_limit = 0.6;
+    conf.pressure_threshold = 10;
+    conf.max_pressure_deferral = 10 * 60;
+    conf.dimmer_timeout = 45;
+    conf.capture_freshness = 10;
+    conf.dimmer_pct = 0.2;
+    conf.hooks_concurrency = 2;
+    memcpy(conf.dpms_timeouts, default_dpms_timeouts, sizeof(conf.dpms_timeouts));
 
     read_config(GLOBAL);
     read_config(LOCAL);
@@ -44,9 +60,33 @@ static void parse_cmd(int argc, char *const argv[]) {
         {"night_temp", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &conf.temp[NIGHT], 0, "Nightly gamma temperature, between 1000 and 10000", NULL},
         {"lat", 0, POPT_ARG_DOUBLE, &conf.lat, 0, "Your desired latitude", NULL},
         {"lon", 0, POPT_ARG_DOUBLE, &conf.lon, 0, "Your desired longitude", NULL},
+        {"city", 0, POPT_ARG_STRING, NULL, 7, "City whose location is used for gamma correction, optionally followed by country code", "rome,IT"},
         {"sunrise", 0, POPT_ARG_STRING, NULL, 3, "Force sunrise time for gamma correction", "07:00"},
         {"sunset", 0, POPT_ARG_STRING, NULL, 4, "Force sunset time for gamma correction", "19:00"},
         {"no-gamma", 0, POPT_ARG_NONE, &conf.no_gamma, 0, "Disable gamma correction tool", NULL},
+        {"drop_limit", 0, POPT_ARG_DOUBLE | POPT_ARGFLAG_SHOW_DEFAULT, &conf.drop_limit, 0, "Brightness drop that triggers a fast recapture, between 0 and 1", NULL},
+        {"trace", 0, POPT_ARG_STRING, NULL, 5, "Record every ambient brightness capture to file", "/tmp/clight.trace"},
+        {"tune", 0, POPT_ARG_STRING, NULL, 6, "Replay a recorded trace to find best parameters, print them and quit", "/tmp/clight.trace"},
+        {"pressure_threshold", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &conf.pressure_threshold, 0, "Percentage of stall time over which captures and gamma transitions are deferred, between 1 and 100", NULL},
+        {"max_pressure_deferral", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &conf.max_pressure_deferral, 0, "Max seconds captures and gamma transitions can be deferred while system is under pressure", NULL},
+        {"no-pressure", 0, POPT_ARG_NONE, &conf.no_pressure, 0, "Disable system pressure awareness", NULL},
+        {"restore", 0, POPT_ARG_NONE, &conf.restore_on_exit, 0, "Restore initial backlight level and a neutral screen temperature when leaving", NULL},
+        {"no-dead_reckoning", 0, POPT_ARG_NONE, &conf.no_dead_reckoning, 0, "Disable backlight updates between captures along predicted ambient brightness during events", NULL},
+        {"no-dimmer", 0, POPT_ARG_NONE, &conf.no_dimmer, 0, "Disable screen dimmer", NULL},
+        {"dimmer_timeout", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &conf.dimmer_timeout, 0, "Seconds of inactivity before dimming screen", NULL},
+        {"dimmer_pct", 0, POPT_ARG_DOUBLE | POPT_ARGFLAG_SHOW_DEFAULT, &conf.dimmer_pct, 0, "Backlight level used when dimmed, between 0 and 1", NULL},
+        {"ambient_gamma_weight", 0, POPT_ARG_DOUBLE, &conf.ambient_gamma_weight, 0, "How much ambient light color temperature (from webcam white balance or frame source colors) weighs on screen temperature, between 0 and 1", NULL},
+        {"capture_freshness", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &conf.capture_freshness, 0, "Seconds a capture result is reused for instead of capturing again, 0 to disable", NULL},
+        {"no-inhibit", 0, POPT_ARG_NONE, &conf.no_inhibit, 0, "Disable org.freedesktop.ScreenSaver inhibit support", NULL},
+        {"manage_dpms", 0, POPT_ARG_NONE, &conf.manage_dpms, 0, "Set dpms timeouts depending on current state and power source", NULL},
+        {"dpms_timeouts", 0, POPT_ARG_STRING, NULL, 8, "Dpms timeouts on AC, during day, night and events", "900,300,600"},
+        {"batt_dpms_timeouts", 0, POPT_ARG_STRING, NULL, 9, "Dpms timeouts on battery, during day, night and events", "300,120,180"},
+        {"budget", 0, POPT_ARG_STRING, NULL, 13, "Check per day syscalls and wakeups against budgets file on exit, failing if any is exceeded", "Extra/budget.conf"},
+        {"evaluate", 0, POPT_ARG_STRING, NULL, 11, "Evaluate ambient brightness estimators on a labeled frames dataset, print results and quit", "/path/to/dataset"},
+        {"roi", 0, POPT_ARG_STRING, NULL, 12, "Webcam region used for ambient brightness, as fractions of whole view: x,y,width,height", "0.25,0,0.5,0.5"},
+        {"frame_source", 0, POPT_ARG_STRING, NULL, 10, "Take frames from a fake camera instead of webcam", "synth:ramp"},
+        {"no-flicker", 0, POPT_ARG_NONE, &conf.no_flicker, 0, "Disable webcam anti flicker setting from location, and flicker detection on frame sources", NULL},
+        {"tune_samples", 0, POPT_ARG_INT, &conf.tune_samples, 0, "Number of random configurations tried by --tune. By default, a grid search is done", NULL},
         POPT_AUTOHELP
         POPT_TABLEEND
     };
@@ -67,6 +107,36 @@ static void parse_cmd(int argc, char *const argv[]) {
             case 4:
                 strncpy(conf.events[SUNSET], poptGetOptArg(pc), sizeof(conf.events[SUNSET]) - 1);
                 break;
+            case 5:
+                strncpy(conf.trace_file, poptGetOptArg(pc), sizeof(conf.trace_file) - 1);
+                break;
+            case 6:
+                strncpy(conf.tune_file, poptGetOptArg(pc), sizeof(conf.tune_file) - 1);
+                break;
+            case 7:
+                strncpy(conf.city, poptGetOptArg(pc), sizeof(conf.city) - 1);
+                break;
+            case 8:
+                parse_dpms_timeouts(poptGetOptArg(pc), conf.dpms_timeouts[ON_AC]);
+                break;
+            case 9:
+                parse_dpms_timeouts(poptGetOptArg(pc), conf.dpms_timeouts[ON_BATTERY]);
+                break;
+            case 10:
+                strncpy(conf.frame_source, poptGetOptArg(pc), sizeof(conf.frame_source) - 1);
+                break;
+            case 11:
+                strncpy(conf.evaluate_dir, poptGetOptArg(pc), sizeof(conf.evaluate_dir) - 1);
+                break;
+            case 12:
+                if (sscanf(poptGetOptArg(pc), "%lf,%lf,%lf,%lf", &conf.roi[0], &conf.roi[1], &conf.roi[2], &conf.roi[3]) != 4) {
+                    WARN("Wrong roi format.\n");
+                    memset(conf.roi, 0, sizeof(conf.roi));
+                }
+                break;
+            case 13:
+                strncpy(conf.budget_file, poptGetOptArg(pc), sizeof(conf.budget_file) - 1);
+                break;
         }
     }
     // poptGetNextOpt returns -1 when the final argument has been parsed
@@ -77,6 +147,15 @@ static void parse_cmd(int argc, char *const argv[]) {
     poptFreeContext(pc);
 }
 
+/*
+ * Parse "day,night,event" dpms timeouts string.
+ */
+static void parse_dpms_timeouts(const char *str, int *timeouts) {
+    if (sscanf(str, "%d,%d,%d", &timeouts[DAY], &timeouts[NIGHT], &timeouts[EVENT]) != 3) {
+        WARN("Wrong dpms timeouts format: %s.\n", str);
+    }
+}
+
 void check_conf(void) {
     /*
      * Reset default values in case of wrong values
@@ -105,9 +184,73 @@ void check_conf(void) {
         WARN("Wrong nightly temp value. Resetting default value.\n");
         conf.temp[NIGHT] = 4000;
     }
+    if (conf.pressure_threshold <= 0 || conf.pressure_threshold > 100) {
+        WARN("Wrong pressure threshold value. Resetting default value.\n");
+        conf.pressure_threshold = 10;
+    }
+    if (conf.max_pressure_deferral < 0) {
+        WARN("Wrong max pressure deferral value. Resetting default value.\n");
+        conf.max_pressure_deferral = 10 * 60;
+    }
+    if (conf.ambient_gamma_weight < 0 || conf.ambient_gamma_weight > 1) {
+        WARN("Wrong ambient gamma weight value. Disabling ambient gamma.\n");
+        conf.ambient_gamma_weight = 0;
+    }
+    if (conf.capture_freshness < 0) {
+        WARN("Wrong capture freshness value. Resetting default value.\n");
+        conf.capture_freshness = 10;
+    }
+    if (conf.dimmer_timeout <= 0) {
+        WARN("Wrong dimmer timeout value. Resetting default value.\n");
+        conf.dimmer_timeout = 45;
+    }
+    if (conf.dimmer_pct <= 0 || conf.dimmer_pct > 1) {
+        WARN("Wrong dimmer backlight level value. Resetting default value.\n");
+        conf.dimmer_pct = 0.2;
+    }
+    if (conf.hooks_concurrency <= 0) {
+        WARN("Wrong hooks concurrency value. Resetting default value.\n");
+        conf.hooks_concurrency = 2;
+    }
+    for (int i = 0; i < conf.num_hooks; i++) {
+        if (conf.hooks[i].timeout <= 0) {
+            WARN("Wrong timeout for hook on %s. Resetting default value.\n", conf.hooks[i].event);
+            conf.hooks[i].timeout = HOOK_TIMEOUT;
+        }
+    }
+    if (conf.roi[2] > 0) {
+        check_roi(conf.roi);
+    }
+    for (int i = 0; i < conf.num_rois; i++) {
+        check_roi(conf.rois[i].roi);
+    }
+    for (int i = 0; i < SIZE_AC; i++) {
+        for (int j = DAY; j < SIZE_STATES; j++) {
+            if (conf.dpms_timeouts[i][j] <= 0 || conf.dpms_timeouts[i][j] > UINT16_MAX) {
+                WARN("Wrong dpms timeout value. Resetting default value.\n");
+                conf.dpms_timeouts[i][j] = default_dpms_timeouts[i][j];
+            }
+        }
+        conf.dpms_timeouts[i][UNKNOWN] = conf.dpms_timeouts[i][DAY];
+    }
+    if (conf.drop_limit <= 0 || conf.drop_limit > 1) {
+        WARN("Wrong drop limit value. Resetting default value.\n");
+        conf.drop_limit = 0.6;
+    }
     /* Disable gamma support if we're not in a X session */
     if (!getenv("XDG_SESSION_TYPE") || strcmp(getenv("XDG_SESSION_TYPE"), "x11")) {
         WARN("Disabling gamma support as X is not running.\n");
         conf.no_gamma = 1;
     }
 }
+
+/*
+ * A region of interest must lie inside webcam view.
+ */
+static void check_roi(double *roi) {
+    if (roi[0] < 0 || roi[1] < 0 || roi[2] <= 0 || roi[3] <= 0 || roi[0] + roi[2] > 1 || roi[1] + roi[3] > 1) {
+        WARN("Wrong roi value. Whole webcam view will be used.\n");
+        roi[0] = roi[1] = 0.0;
+        roi[2] = roi[3] = 1.0;
+    }
+}
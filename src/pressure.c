@@ -0,0 +1,125 @@
+#include "../inc/pressure.h"
+#include "../inc/stream.h"
+#include "../inc/stats.h"
+#include <sys/epoll.h>
+#include <fcntl.h>
+
+#define PRESSURE_WINDOW 2           // PSI trigger window, in seconds (unprivileged triggers need a multiple of 2s)
+
+enum resources { CPU, IO, MEMORY, SIZE_RESOURCES };
+
+static void pressure_cb(void);
+static int is_under_pressure(void);
+
+static const char *resources_dict[SIZE_RESOURCES] = {"cpu", "io", "memory"};
+static int psi_fds[SIZE_RESOURCES] = {-1, -1, -1};
+static time_t last_trigger;         // last time (CLOCK_MONOTONIC) a PSI trigger fired, 0 if never
+
+/*
+ * Register a PSI trigger on /proc/pressure/{cpu,io,memory}: kernel will notify us (POLLPRI)
+ * whenever tasks stall for more than conf.pressure_threshold percent of a PRESSURE_WINDOW window.
+ * While pressure is high, triggers keep firing once per window:
+ * we consider system under pressure until no trigger fires for 2 windows.
+ * Every trigger fd is added to an epoll fd, that is the one polled by main poll.
+ * Thus, no wakeup at all happens while system is not under pressure.
+ */
+void init_pressure(void) {
+    int fd = DONT_POLL_W_ERR;
+    char trigger[64];
+
+    if (conf.no_pressure) {
+        return;
+    }
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        WARN("%s\n", strerror(errno));
+        goto end;
+    }
+
+    snprintf(trigger, sizeof(trigger), "some %d %d",
+             conf.pressure_threshold * PRESSURE_WINDOW * 10 * 1000, PRESSURE_WINDOW * 1000 * 1000);
+    for (int i = 0; i < SIZE_RESOURCES; i++) {
+        char path[PATH_MAX + 1];
+
+        snprintf(path, PATH_MAX, "/proc/pressure/%s", resources_dict[i]);
+        psi_fds[i] = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (psi_fds[i] == -1) {
+            continue;
+        }
+
+        struct epoll_event ev = { .events = EPOLLPRI, .data.u32 = i };
+        if (write(psi_fds[i], trigger, strlen(trigger) + 1) == -1
+            || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, psi_fds[i], &ev) == -1) {
+            close(psi_fds[i]);
+            psi_fds[i] = -1;
+            continue;
+        }
+        fd = epoll_fd;
+    }
+
+end:
+    /* PSI needs a kernel >= 4.20 with CONFIG_PSI: do not leave if it is not available */
+    if (fd == DONT_POLL_W_ERR) {
+        WARN("System pressure information not available.\n");
+        if (epoll_fd != -1) {
+            close(epoll_fd);
+        }
+    }
+    init_module(fd, PRESSURE_IX, pressure_cb, destroy_pressure);
+}
+
+static void pressure_cb(void) {
+    struct epoll_event evs[SIZE_RESOURCES];
+
+    COUNT(POLL_CNT);
+    int r = epoll_wait(main_p[PRESSURE_IX].fd, evs, SIZE_RESOURCES, 0);
+    if (r <= 0) {
+        return;
+    }
+
+    if (!is_under_pressure()) {
+        INFO("System is under %s pressure. Deferring non urgent work.\n", resources_dict[evs[0].data.u32]);
+    }
+    last_trigger = get_monotonic_time();
+    for (int i = 0; i < r; i++) {
+        STREAM("pressure", "\"resource\":\"%s\"", resources_dict[evs[i].data.u32]);
+    }
+}
+
+static int is_under_pressure(void) {
+    return last_trigger && get_monotonic_time() - last_trigger <= 2 * PRESSURE_WINDOW;
+}
+
+/*
+ * Whether caller should defer its non urgent work (eg: a capture) because system is under pressure.
+ * *since stores when caller started deferring (0 if it is not deferring):
+ * after conf.max_pressure_deferral seconds, work is not deferred anymore.
+ * Caller resets it to 0 once its work is done (eg: transition ended or capture ran),
+ * so that bound holds for the whole work, not just for each of its steps.
+ */
+int defer_for_pressure(time_t *since) {
+    if (!modules[PRESSURE_IX].inited || !is_under_pressure()) {
+        return 0;
+    }
+
+    time_t now = get_monotonic_time();
+    if (*since == 0) {
+        *since = now;
+    }
+    if (now - *since >= conf.max_pressure_deferral) {
+        return 0;
+    }
+    return 1;
+}
+
+void destroy_pressure(void) {
+    for (int i = 0; i < SIZE_RESOURCES; i++) {
+        if (psi_fds[i] != -1) {
+            close(psi_fds[i]);
+        }
+    }
+    if (main_p[PRESSURE_IX].fd > 0) {
+        close(main_p[PRESSURE_IX].fd);
+    }
+}
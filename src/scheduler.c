@@ -0,0 +1,125 @@
+#include "../inc/scheduler.h"
+#include "../inc/gamma.h"
+
+#define FAST_TIMEOUT 15             // seconds before a fast recapture, after a weird brightness drop
+#define PRESSURE_TIMEOUT 30         // seconds before retrying a capture deferred because of pressure
+#define DR_STEP_TIMEOUT 60          // seconds between dead reckoned backlight updates
+#define DR_MAX_STEP 0.02            // max backlight change for each dead reckoned update
+#define DR_MIN_STEP 0.01            // do not write backlight for smaller changes
+#define DR_MAX_DRIFT 0.15           // max distance of dead reckoned backlight from last captured value
+#define HORIZON_SKY 0.05            // sky brightness (normalized) when sun is at horizon
+
+static double sky_brightness(const struct sched_params *p, time_t t);
+
+/*
+ * Capture scheduling decisions, without side effects: brightness module applies them to real time,
+ * tuner replays them under simulated time, so that tuned parameters match real behavior.
+ */
+
+/*
+ * Decide what to do once capture timer expired, in this order:
+ * skip capture while screen is blanked (with a timeout that grows as screen power management goes deeper),
+ * wait while screen is dimmed or screensaver inhibited (timeout is -1: capture timer is left disarmed),
+ * defer it while system is under pressure, reuse last result if it was requested while last capture was in flight
+ * or if it is younger than capture_freshness (unless it is a fast recapture, as it is there to double check
+ * last result), or capture.
+ * timeout is set to seconds before next capture for every action but CAPTURE_DO,
+ * whose timeout is given by capture_done() or capture_failed().
+ */
+enum capture_actions capture_action(const struct sched_params *p, const struct sched_state *s,
+                                    const struct sched_env *e, time_t now, int *timeout) {
+    *timeout = p->timeout[e->state];
+    if (e->dpms > 0) {
+        *timeout = 2 * p->timeout[e->state] * e->dpms;
+        return CAPTURE_SKIP_DPMS;
+    }
+    if (e->paused) {
+        *timeout = -1;
+        return CAPTURE_PAUSED;
+    }
+    if (e->under_pressure && e->under_pressure()) {
+        *timeout = PRESSURE_TIMEOUT;
+        return CAPTURE_DEFER;
+    }
+    if (s->last_capture && (s->reuse_last || (!s->fast_recapture && now - s->last_capture < p->capture_freshness))) {
+        return CAPTURE_CACHED;
+    }
+    return CAPTURE_DO;
+}
+
+/*
+ * A capture measured ambient brightness, and backlight moved by drop (fraction of max):
+ * re-anchor dead reckoning, and if drop is too high, do a fast recapture to be sure it is correct.
+ * Returns seconds before next capture.
+ */
+int capture_done(const struct sched_params *p, struct sched_state *s, const struct sched_env *e,
+                 time_t now, time_t wall, double ambient, double drop) {
+    s->last_capture = now;
+    s->reuse_last = 0;
+    s->captured = 1;
+    s->anchor = s->dr_perc = ambient;
+    s->anchor_sky = p->dead_reckoning ? sky_brightness(p, wall) : 0;
+    s->fast_recapture = fabs(drop) > p->drop_limit;
+    return s->fast_recapture ? FAST_TIMEOUT : p->timeout[e->state];
+}
+
+/*
+ * Capture timed out: just retry at next timeout.
+ */
+int capture_failed(const struct sched_params *p, struct sched_state *s, const struct sched_env *e) {
+    s->fast_recapture = 0;
+    s->reuse_last = 0;
+    return p->timeout[e->state];
+}
+
+/*
+ * Dead reckoning is only useful during events (ie: dusk and dawn),
+ * when ambient brightness changes fastest, and needs our location.
+ * It is not used while a fast recapture is pending, as last capture is not trustworthy.
+ */
+int dead_reckoning_active(const struct sched_params *p, const struct sched_state *s, enum states st) {
+    return p->dead_reckoning && st == EVENT && s->captured && !s->fast_recapture && s->anchor_sky > 0;
+}
+
+/*
+ * Rough normalized clear sky brightness proxy, given sun elevation:
+ * sin(elevation) above horizon, exponential decay during twilight.
+ */
+static double sky_brightness(const struct sched_params *p, time_t t) {
+    double el = get_sun_elevation(t, p->lat, p->lon);
+
+    if (el >= 0) {
+        return HORIZON_SKY + (1 - HORIZON_SKY) * sin(M_PI * el / 180);
+    }
+    return HORIZON_SKY * exp(el / 6);
+}
+
+/*
+ * Predict ambient brightness along sky brightness curve, scaled by last measured ambient to sky ratio,
+ * and move s->dr_perc towards it by at most DR_MAX_STEP, never further than DR_MAX_DRIFT from last capture.
+ * Returns 1 if backlight should be set to new s->dr_perc.
+ */
+int dead_reckoning_step(const struct sched_params *p, struct sched_state *s, time_t wall) {
+    double predicted = s->anchor * sky_brightness(p, wall) / s->anchor_sky;
+    predicted = fmax(predicted, s->anchor - DR_MAX_DRIFT);
+    predicted = fmin(predicted, s->anchor + DR_MAX_DRIFT);
+    predicted = fmax(0.0, fmin(1.0, predicted));
+
+    double step = fmax(-DR_MAX_STEP, fmin(DR_MAX_STEP, predicted - s->dr_perc));
+    if (fabs(step) >= DR_MIN_STEP) {
+        s->dr_perc += step;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Capture timer timeout, given seconds before next capture:
+ * while dead reckoning is active, timer fires every DR_STEP_TIMEOUT seconds until then.
+ */
+int step_timeout(const struct sched_params *p, const struct sched_state *s, enum states st, int timeout) {
+    if (dead_reckoning_active(p, s, st) && timeout > DR_STEP_TIMEOUT) {
+        return DR_STEP_TIMEOUT;
+    }
+    return timeout;
+}
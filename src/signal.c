@@ -1,11 +1,14 @@
 #include <sys/signalfd.h>
 #include <signal.h>
 #include "../inc/signal.h"
+#include "../inc/energy.h"
+#include "../inc/stats.h"
+#include "../inc/brightness.h"
 
 static void signal_cb(void);
 
 /**
- * Set signals handler for SIGINT and SIGTERM (using a signalfd)
+ * Set signals handler for SIGINT, SIGTERM, SIGUSR1 and SIGUSR2 (using a signalfd)
  */
 void init_signal(void) {
     sigset_t mask;
@@ -13,6 +16,8 @@ void init_signal(void) {
     sigemptyset(&mask);
     sigaddset(&mask, SIGINT);
     sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
     sigprocmask(SIG_BLOCK, &mask, NULL);
 
     int fd = signalfd(-1, &mask, 0);
@@ -22,19 +27,41 @@ void init_signal(void) {
 /*
  * if received an external SIGINT or SIGTERM,
  * just switch the quit flag to 1 and print to stdout.
+ * On SIGUSR1, log syscalls counters and energy stats; on SIGUSR2, request a capture.
  */
 static void signal_cb(void) {
     struct signalfd_siginfo fdsi;
     ssize_t s;
 
+    COUNT(READ_CNT);
     s = read(main_p[SIGNAL_IX].fd, &fdsi, sizeof(struct signalfd_siginfo));
     if (s != sizeof(struct signalfd_siginfo)) {
         return ERROR("an error occurred while getting signalfd data.\n");
     }
+    if (fdsi.ssi_signo == SIGUSR1) {
+        log_stats();
+        return log_energy_stats();
+    }
+    if (fdsi.ssi_signo == SIGUSR2) {
+        return request_capture();
+    }
     INFO("received signal %d. Leaving.\n", fdsi.ssi_signo);
     state.quit = 1;
 }
 
+/*
+ * Whether a SIGINT or SIGTERM is waiting to be read from signalfd, without consuming it:
+ * it will still be handled by signal_cb from main poll.
+ */
+int quit_signal_pending(void) {
+    sigset_t pending;
+
+    if (sigpending(&pending) == -1) {
+        return 0;
+    }
+    return sigismember(&pending, SIGINT) == 1 || sigismember(&pending, SIGTERM) == 1;
+}
+
 void destroy_signal(void) {
     if (main_p[SIGNAL_IX].fd > 0) {
         close(main_p[SIGNAL_IX].fd);
@@ -0,0 +1,65 @@
+#include "../inc/stats.h"
+#include "../inc/config.h"
+#include "../inc/utils.h"
+
+#define BUDGET_MIN_UPTIME 3600      // shorter runs are dominated by startup work: do not check budget
+
+uint64_t counters[SIZE_COUNTERS];
+
+static time_t start;                // CLOCK_MONOTONIC time when we started counting
+static const char *counters_dict[SIZE_COUNTERS] = {
+    "wakeups", "poll", "timerfd_settime", "read", "bus_sent", "bus_process"
+};
+
+void init_stats(void) {
+    start = get_monotonic_time();
+}
+
+/*
+ * Counters, both absolute and per day.
+ */
+void log_stats(void) {
+    const time_t uptime = get_monotonic_time() - start;
+
+    INFO("Counters after %lds:\n", (long)uptime);
+    for (int i = 0; i < SIZE_COUNTERS; i++) {
+        INFO("* %s: %lu (%.0lf/day)\n", counters_dict[i], (unsigned long)counters[i],
+             uptime > 0 ? counters[i] * 86400.0 / uptime : 0.0);
+    }
+}
+
+/*
+ * Compare per day counters against per day budgets stored in conf.budget_file
+ * (see Extra/budget.conf). Returns -1 if any budget is exceeded, or if nothing could be judged:
+ * run was too short, or file has no budget at all.
+ */
+int check_budget(void) {
+    double budget[SIZE_COUNTERS];
+    const time_t uptime = get_monotonic_time() - start;
+    int ret = 0, checked = 0;
+
+    if (read_budget(conf.budget_file, counters_dict, SIZE_COUNTERS, budget) == -1) {
+        return -1;
+    }
+    if (uptime < BUDGET_MIN_UPTIME) {
+        WARN("Ran for %lds only, at least %ds are needed: budget not checked.\n", (long)uptime, BUDGET_MIN_UPTIME);
+        return -1;
+    }
+
+    for (int i = 0; i < SIZE_COUNTERS; i++) {
+        const double per_day = counters[i] * 86400.0 / uptime;
+        checked += budget[i] >= 0;
+        if (budget[i] >= 0 && per_day > budget[i]) {
+            WARN("%s budget exceeded: %.0lf/day, budget is %.0lf/day.\n", counters_dict[i], per_day, budget[i]);
+            ret = -1;
+        }
+    }
+    if (!checked) {
+        WARN("No budget set in %s: nothing checked.\n", conf.budget_file);
+        return -1;
+    }
+    if (!ret) {
+        INFO("Every budget respected.\n");
+    }
+    return ret;
+}
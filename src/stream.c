@@ -0,0 +1,290 @@
+#include "../inc/stream.h"
+#include "../inc/event.h"
+#include "../inc/stats.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#define MAX_STREAM_CLIENTS 16
+#define STREAM_BUF_SIZE (16 * 1024)  // max bytes queued for a client before it gets dropped
+#define MAX_MSG_SIZE 512
+#define LISTENER UINT64_MAX         // epoll data of listening socket; clients have their index as epoll data
+
+static void stream_cb(void);
+static void init_socket_path(void);
+static void accept_client(void);
+static void client_cb(struct epoll_event *ev);
+static int flush_client(int i);
+static void drop_client(int i);
+static void stream_event_cb(const struct event *ev);
+
+/*
+ * A connected client, with data still to be sent to it.
+ */
+struct stream_client {
+    int fd;
+    size_t len;
+    char buf[STREAM_BUF_SIZE];
+};
+
+int stream_clients;
+
+static struct stream_client clients[MAX_STREAM_CLIENTS];
+static int sock_fd = -1;
+static char sock_path[PATH_MAX + 1];
+static const char *states_dict[SIZE_STATES] = {"unknown", "day", "night", "event"};
+
+/*
+ * Create a unix socket where clients can connect to receive a live stream
+ * of newline delimited json events. Listening socket and every client are
+ * handled through an epoll fd, that is the one polled by main poll.
+ */
+void init_stream(void) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd = -1;
+
+    init_socket_path();
+    if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+        WARN("Event stream socket path too long. Event stream disabled.\n");
+        goto end;
+    }
+    strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+
+    sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock_fd == -1) {
+        WARN("%s\n", strerror(errno));
+        goto end;
+    }
+    /* we own clight lock: any old socket was left by a crashed instance */
+    unlink(sock_path);
+    /* create socket with 0600 permissions: a chmod after bind would leave it open to other users meanwhile */
+    mode_t old_mask = umask(S_IRWXG | S_IRWXO | S_IXUSR);
+    int r = bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+    if (r == -1 || listen(sock_fd, MAX_STREAM_CLIENTS) == -1) {
+        WARN("Failed to create event stream socket: %s\n", strerror(errno));
+        goto end;
+    }
+
+    fd = epoll_create1(EPOLL_CLOEXEC);
+    if (fd == -1) {
+        WARN("%s\n", strerror(errno));
+        goto end;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = LISTENER };
+    if (epoll_ctl(fd, EPOLL_CTL_ADD, sock_fd, &ev) == -1) {
+        WARN("%s\n", strerror(errno));
+        close(fd);
+        fd = -1;
+        goto end;
+    }
+
+    for (int i = 0; i < MAX_STREAM_CLIENTS; i++) {
+        clients[i].fd = -1;
+    }
+    for (int i = 0; i < EVENT_TYPES_NUM; i++) {
+        subscribe_event(i, stream_event_cb);
+    }
+
+end:
+    /* event stream is not needed by clight to work: do not leave on error */
+    if (fd == -1) {
+        if (sock_fd != -1) {
+            close(sock_fd);
+            sock_fd = -1;
+        }
+        fd = DONT_POLL_W_ERR;
+    }
+    init_module(fd, STREAM_IX, stream_cb, destroy_stream);
+}
+
+/*
+ * Socket is placed in $XDG_RUNTIME_DIR/clight.sock,
+ * or in $HOME/.clight.sock if XDG_RUNTIME_DIR is not set.
+ */
+static void init_socket_path(void) {
+    if (getenv("XDG_RUNTIME_DIR")) {
+        snprintf(sock_path, PATH_MAX, "%s/clight.sock", getenv("XDG_RUNTIME_DIR"));
+    } else {
+        snprintf(sock_path, PATH_MAX, "%s/.clight.sock", getpwuid(getuid())->pw_dir);
+    }
+}
+
+static void stream_cb(void) {
+    struct epoll_event evs[MAX_STREAM_CLIENTS + 1];
+
+    COUNT(POLL_CNT);
+    int r = epoll_wait(main_p[STREAM_IX].fd, evs, MAX_STREAM_CLIENTS + 1, 0);
+    for (int i = 0; i < r; i++) {
+        if (evs[i].data.u64 == LISTENER) {
+            accept_client();
+        } else {
+            client_cb(&evs[i]);
+        }
+    }
+}
+
+static void accept_client(void) {
+    int fd = accept(sock_fd, NULL, NULL);
+    if (fd == -1) {
+        return;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    for (int i = 0; i < MAX_STREAM_CLIENTS; i++) {
+        if (clients[i].fd == -1) {
+            struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.u64 = i };
+            if (epoll_ctl(main_p[STREAM_IX].fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+                break;
+            }
+            clients[i].fd = fd;
+            clients[i].len = 0;
+            stream_clients++;
+            INFO("New event stream client.\n");
+            return;
+        }
+    }
+    WARN("Too many event stream clients.\n");
+    close(fd);
+}
+
+/*
+ * Client hanged up, or sent us something (that is just discarded),
+ * or its socket is writable again: flush queued data.
+ */
+static void client_cb(struct epoll_event *ev) {
+    int i = ev->data.u64;
+
+    if (ev->events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+        return drop_client(i);
+    }
+    if (ev->events & EPOLLIN) {
+        char tmp[256];
+        if (read(clients[i].fd, tmp, sizeof(tmp)) == 0) {
+            return drop_client(i);
+        }
+    }
+    if (ev->events & EPOLLOUT) {
+        flush_client(i);
+    }
+}
+
+/*
+ * Try to send every queued byte to client, without blocking.
+ * If not everything can be sent, listen for EPOLLOUT on client socket.
+ */
+static int flush_client(int i) {
+    struct stream_client *c = &clients[i];
+
+    while (c->len > 0) {
+        ssize_t r = send(c->fd, c->buf, c->len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (r == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            drop_client(i);
+            return -1;
+        }
+        c->len -= r;
+        memmove(c->buf, c->buf + r, c->len);
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | (c->len ? EPOLLOUT : 0), .data.u64 = i };
+    epoll_ctl(main_p[STREAM_IX].fd, EPOLL_CTL_MOD, c->fd, &ev);
+    return 0;
+}
+
+static void drop_client(int i) {
+    close(clients[i].fd);
+    clients[i].fd = -1;
+    clients[i].len = 0;
+    stream_clients--;
+    INFO("Event stream client left.\n");
+}
+
+/*
+ * Format event as a json line and queue it to every client.
+ * fields is a printf format string of comma separated json members.
+ * A client that has not yet read STREAM_BUF_SIZE bytes of events is too slow: drop it,
+ * so that we never block main poll.
+ */
+void stream_message(const char *type, const char *fields, ...) {
+    char msg[MAX_MSG_SIZE];
+    va_list args;
+
+    int len = snprintf(msg, sizeof(msg), "{\"time\":%ld,\"type\":\"%s\",", (long)time(NULL), type);
+    va_start(args, fields);
+    len += vsnprintf(msg + len, sizeof(msg) - len, fields, args);
+    va_end(args);
+    if (len >= (int)sizeof(msg) - 2) {
+        return WARN("Event stream message too long.\n");
+    }
+    len += snprintf(msg + len, sizeof(msg) - len, "}\n");
+
+    for (int i = 0; i < MAX_STREAM_CLIENTS; i++) {
+        struct stream_client *c = &clients[i];
+        if (c->fd == -1) {
+            continue;
+        }
+        if (c->len + len > STREAM_BUF_SIZE) {
+            WARN("Event stream client too slow. Dropping it.\n");
+            drop_client(i);
+            continue;
+        }
+        memcpy(c->buf + c->len, msg, len);
+        c->len += len;
+        flush_client(i);
+    }
+}
+
+/*
+ * Stream internal events too.
+ */
+static void stream_event_cb(const struct event *ev) {
+    switch (ev->type) {
+        case LOCATION_CHANGED:
+            STREAM("location", "\"lat\":%.2lf,\"lon\":%.2lf", ev->location.lat, ev->location.lon);
+            break;
+        case STATE_CHANGED:
+            STREAM("state", "\"old\":\"%s\",\"new\":\"%s\"", states_dict[ev->state.old], states_dict[ev->state.current]);
+            break;
+        case AMBIENT_MEASURED:
+            STREAM("estimate", "\"ambient\":%lf", ev->ambient);
+            break;
+        case DISPLAY_POWER_CHANGED:
+            STREAM("dpms", "\"level\":%d", ev->dpms);
+            break;
+        case POWER_SOURCE_CHANGED:
+            STREAM("power", "\"source\":\"%s\"", ev->on_battery ? "battery" : "ac");
+            break;
+        case AMBIENT_TEMP_MEASURED:
+            STREAM("ambient_temp", "\"temp\":%d", ev->ambient_temp);
+            break;
+        case INHIBIT_CHANGED:
+            STREAM("inhibit", "\"inhibited\":%s", ev->inhibited ? "true" : "false");
+            break;
+        case DIMMED_CHANGED:
+            STREAM("dimmer", "\"dimmed\":%s", ev->dimmed ? "true" : "false");
+            break;
+        default:
+            break;
+    }
+}
+
+void destroy_stream(void) {
+    for (int i = 0; i < MAX_STREAM_CLIENTS; i++) {
+        if (clients[i].fd != -1) {
+            close(clients[i].fd);
+        }
+    }
+    if (sock_fd != -1) {
+        close(sock_fd);
+        unlink(sock_path);
+    }
+    if (main_p[STREAM_IX].fd > 0) {
+        close(main_p[STREAM_IX].fd);
+    }
+}
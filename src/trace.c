@@ -0,0 +1,77 @@
+#include "../inc/trace.h"
+#include "../inc/event.h"
+
+static void ambient_measured_cb(const struct event *ev);
+
+static FILE *trace_file;
+
+/*
+ * If conf.trace_file is set, open it in append mode and
+ * record there every ambient brightness capture, one per line, as:
+ * "timestamp state ambient_brightness"
+ */
+void init_trace(void) {
+    if (strlen(conf.trace_file)) {
+        trace_file = fopen(conf.trace_file, "a");
+        if (!trace_file) {
+            return WARN("Could not open trace file %s: %s\n", conf.trace_file, strerror(errno));
+        }
+        subscribe_event(AMBIENT_MEASURED, ambient_measured_cb);
+        INFO("Recording ambient brightness trace to %s.\n", conf.trace_file);
+    }
+}
+
+static void ambient_measured_cb(const struct event *ev) {
+    fprintf(trace_file, "%ld %d %lf\n", (long)time(NULL), state.time, ev->ambient);
+    fflush(trace_file);
+}
+
+/*
+ * Load a recorded trace into a newly allocated *samples array.
+ * Malformed or out of order lines are skipped.
+ * Returns number of loaded samples, or -1 on error.
+ */
+int load_trace(const char *path, struct trace_sample **samples) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        WARN("Could not open trace file %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    int num = 0, size = 0;
+    long t;
+    int st;
+    double ambient;
+    char line[128];
+
+    *samples = NULL;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%ld %d %lf", &t, &st, &ambient) != 3 || st < UNKNOWN || st >= SIZE_STATES) {
+            continue;
+        }
+        if (num > 0 && t <= (*samples)[num - 1].t) {
+            continue;
+        }
+        if (num == size) {
+            size = size ? 2 * size : 256;
+            struct trace_sample *tmp = realloc(*samples, size * sizeof(struct trace_sample));
+            if (!tmp) {
+                free(*samples);
+                *samples = NULL;
+                fclose(f);
+                WARN("%s\n", strerror(errno));
+                return -1;
+            }
+            *samples = tmp;
+        }
+        (*samples)[num++] = (struct trace_sample) { .t = t, .state = st, .ambient = ambient };
+    }
+    fclose(f);
+    return num;
+}
+
+void destroy_trace(void) {
+    if (trace_file) {
+        fclose(trace_file);
+    }
+}
@@ -0,0 +1,282 @@
+#include "../inc/tuner.h"
+#include "../inc/trace.h"
+#include "../inc/scheduler.h"
+#include <pthread.h>
+
+#define SIM_STEP 5                  // simulated time resolution, in seconds
+#define FRAME_NOISE 0.05            // std deviation of ambient brightness computed from a single frame
+#define FRAME_COST 0.005            // cost of a single captured frame, in tracking error percent points
+#define WRITE_COST 0.02             // cost of a single backlight write, in tracking error percent points
+#define TOP_RESULTS 10              // number of best configurations to be printed
+
+/* Parameters tried by the tuner */
+struct tune_params {
+    int timeout[SIZE_STATES];
+    int frames;
+    double drop_limit;
+};
+
+/* Simulation results for a set of parameters */
+struct tune_result {
+    struct tune_params p;
+    double captures;                // captures per day
+    double writes;                  // backlight writes per day
+    double error;                   // mean abs difference between ambient brightness and backlight level, in percent
+    double cost;                    // error + weighted frames and writes per day; lower is better
+};
+
+/* Work assigned to each simulation thread */
+struct tune_job {
+    const struct trace_sample *samples;
+    int num_samples;
+    struct tune_result *results;
+    int num_results;
+    int first;
+    int step;
+};
+
+static int build_grid(struct tune_result **results);
+static int build_random(struct tune_result **results, int num);
+static void run_simulations(const struct trace_sample *samples, int num_samples, struct tune_result *results, int num);
+static void *tune_thread(void *arg);
+static void simulate(const struct trace_sample *samples, int num_samples, struct tune_result *res, unsigned int seed);
+static double gaussian_noise(unsigned int *seed);
+static int cmp_results(const void *a, const void *b);
+static void print_results(const struct tune_result *results, int num, const struct tune_result *current);
+
+static const int day_timeouts[] = { 300, 600, 900, 1200, 1800 };
+static const int night_timeouts[] = { 1200, 1800, 2700, 3600 };
+static const int event_timeouts[] = { 60, 120, 180, 300 };
+static const int frames[] = { 1, 3, 5, 10 };
+static const double drop_limits[] = { 0.4, 0.6, 0.8 };
+
+#define SIZE(a) (int)(sizeof(a) / sizeof(*a))
+
+/*
+ * Replay trace recorded in conf.tune_file (see trace.c) under simulated time,
+ * for every configuration of a grid (or conf.tune_samples random ones), spreading them on every cpu.
+ * Between two recorded captures, ambient brightness is linearly interpolated:
+ * traces recorded with short timeouts give better results.
+ * Configurations are ranked by their cost, and best one is printed as a clight.conf fragment.
+ */
+void tune(void) {
+    struct trace_sample *samples = NULL;
+    struct tune_result *results = NULL;
+
+    int num_samples = load_trace(conf.tune_file, &samples);
+    if (num_samples < 2) {
+        WARN("Not enough samples in trace file %s.\n", conf.tune_file);
+        goto end;
+    }
+
+    int num = conf.tune_samples > 0 ? build_random(&results, conf.tune_samples) : build_grid(&results);
+    if (num <= 0) {
+        goto end;
+    }
+
+    run_simulations(samples, num_samples, results, num);
+
+    /* Simulate current configuration too, to compare it against best ones */
+    struct tune_result current = { .p.frames = conf.num_captures, .p.drop_limit = conf.drop_limit };
+    memcpy(current.p.timeout, conf.timeout, sizeof(conf.timeout));
+    simulate(samples, num_samples, &current, num + 1);
+
+    qsort(results, num, sizeof(struct tune_result), cmp_results);
+    print_results(results, num, &current);
+
+end:
+    free(samples);
+    free(results);
+}
+
+/*
+ * Spread simulations of every configuration on every cpu.
+ */
+static void run_simulations(const struct trace_sample *samples, int num_samples, struct tune_result *results, int num) {
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads < 1) {
+        num_threads = 1;
+    } else if (num_threads > num) {
+        num_threads = num;
+    }
+
+    pthread_t threads[num_threads];
+    struct tune_job jobs[num_threads];
+    int started[num_threads];
+    for (int i = 0; i < num_threads; i++) {
+        jobs[i] = (struct tune_job) { samples, num_samples, results, num, i, num_threads };
+        started[i] = pthread_create(&threads[i], NULL, tune_thread, &jobs[i]) == 0;
+        if (!started[i]) {
+            /* could not start a new thread: run this job in main thread */
+            tune_thread(&jobs[i]);
+        }
+    }
+    for (int i = 0; i < num_threads; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+}
+
+static int build_grid(struct tune_result **results) {
+    int num = SIZE(day_timeouts) * SIZE(night_timeouts) * SIZE(event_timeouts) * SIZE(frames) * SIZE(drop_limits);
+    *results = calloc(num, sizeof(struct tune_result));
+    if (!*results) {
+        WARN("%s\n", strerror(errno));
+        return -1;
+    }
+
+    int i = 0;
+    for (int d = 0; d < SIZE(day_timeouts); d++) {
+        for (int n = 0; n < SIZE(night_timeouts); n++) {
+            for (int e = 0; e < SIZE(event_timeouts); e++) {
+                for (int f = 0; f < SIZE(frames); f++) {
+                    for (int l = 0; l < SIZE(drop_limits); l++) {
+                        struct tune_params *p = &(*results)[i++].p;
+                        p->timeout[DAY] = p->timeout[UNKNOWN] = day_timeouts[d];
+                        p->timeout[NIGHT] = night_timeouts[n];
+                        p->timeout[EVENT] = event_timeouts[e];
+                        p->frames = frames[f];
+                        p->drop_limit = drop_limits[l];
+                    }
+                }
+            }
+        }
+    }
+    return num;
+}
+
+/*
+ * Random configurations are drawn inside grid ranges, with a fixed seed
+ * so that results are reproducible.
+ */
+static int build_random(struct tune_result **results, int num) {
+    unsigned int seed = 1;
+
+    *results = calloc(num, sizeof(struct tune_result));
+    if (!*results) {
+        WARN("%s\n", strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < num; i++) {
+        struct tune_params *p = &(*results)[i].p;
+        p->timeout[DAY] = p->timeout[UNKNOWN] = day_timeouts[0] + rand_r(&seed) % (day_timeouts[SIZE(day_timeouts) - 1] - day_timeouts[0] + 1);
+        p->timeout[NIGHT] = night_timeouts[0] + rand_r(&seed) % (night_timeouts[SIZE(night_timeouts) - 1] - night_timeouts[0] + 1);
+        p->timeout[EVENT] = event_timeouts[0] + rand_r(&seed) % (event_timeouts[SIZE(event_timeouts) - 1] - event_timeouts[0] + 1);
+        p->frames = 1 + rand_r(&seed) % 20;
+        p->drop_limit = 0.2 + 0.8 * rand_r(&seed) / RAND_MAX;
+    }
+    return num;
+}
+
+static void *tune_thread(void *arg) {
+    struct tune_job *job = (struct tune_job *)arg;
+
+    for (int i = job->first; i < job->num_results; i += job->step) {
+        simulate(job->samples, job->num_samples, &job->results[i], i + 1);
+    }
+    return NULL;
+}
+
+/*
+ * Run brightness module scheduling logic (see scheduler.c) under simulated time:
+ * each capture measures interpolated ambient brightness plus a noise
+ * that decreases with number of frames; backlight is written (in percent steps)
+ * only if it changed, both after captures and dead reckoning steps.
+ * Screen is never blanked nor dimmed, and system is never under pressure.
+ * Each configuration gets its own seed, so results do not depend on threads scheduling.
+ */
+static void simulate(const struct trace_sample *samples, int num_samples, struct tune_result *res, unsigned int seed) {
+    const time_t end = samples[num_samples - 1].t;
+    const double days = (double)(end - samples[0].t) / (24 * 60 * 60);
+    const struct sched_params p = {
+        .timeout = res->p.timeout,
+        .drop_limit = res->p.drop_limit,
+        .capture_freshness = conf.capture_freshness,
+        .dead_reckoning = !conf.no_dead_reckoning && (conf.lat != 0 || conf.lon != 0),
+        .lat = conf.lat,
+        .lon = conf.lon
+    };
+    struct sched_state s = { 0 };
+    time_t next_capture = samples[0].t, next_wakeup = samples[0].t;
+    int backlight = -1, i = 0;
+    long captures = 0, writes = 0, steps = 0;
+    double error = 0.0;
+
+    for (time_t t = samples[0].t; t <= end; t += SIM_STEP) {
+        while (i < num_samples - 2 && samples[i + 1].t <= t) {
+            i++;
+        }
+        const double perc = (double)(t - samples[i].t) / (samples[i + 1].t - samples[i].t);
+        const double ambient = samples[i].ambient + perc * (samples[i + 1].ambient - samples[i].ambient);
+        const struct sched_env e = { .state = samples[i].state };
+
+        if (t >= next_wakeup) {
+            int timeout, new_br = backlight;
+
+            if (t < next_capture) {
+                if (dead_reckoning_active(&p, &s, e.state) && dead_reckoning_step(&p, &s, t)) {
+                    new_br = lround(s.dr_perc * 100);
+                }
+                timeout = next_capture - t;
+            } else if (capture_action(&p, &s, &e, t, &timeout) == CAPTURE_DO) {
+                double measured = ambient + gaussian_noise(&seed) * FRAME_NOISE / sqrt(res->p.frames);
+                measured = measured < 0.0 ? 0.0 : (measured > 1.0 ? 1.0 : measured);
+                new_br = lround(measured * 100);
+                captures++;
+                const double drop = backlight == -1 ? 0.0 : (double)(new_br - backlight) / 100;
+                timeout = capture_done(&p, &s, &e, t, t, measured, drop);
+                next_capture = t + timeout;
+            } else {
+                /* CAPTURE_CACHED: last result is reused, backlight does not change */
+                next_capture = t + timeout;
+            }
+
+            if (new_br != backlight) {
+                backlight = new_br;
+                writes++;
+            }
+            next_wakeup = t + step_timeout(&p, &s, e.state, timeout);
+        }
+        error += fabs(ambient * 100 - backlight);
+        steps++;
+    }
+
+    res->captures = days > 0 ? captures / days : captures;
+    res->writes = days > 0 ? writes / days : writes;
+    res->error = error / steps;
+    res->cost = res->error + FRAME_COST * res->captures * res->p.frames + WRITE_COST * res->writes;
+}
+
+/* Box-Muller transform */
+static double gaussian_noise(unsigned int *seed) {
+    double u1 = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+    double u2 = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+    return sqrt(-2.0 * log(u1)) * cos(2 * M_PI * u2);
+}
+
+static int cmp_results(const void *a, const void *b) {
+    const struct tune_result *r1 = (const struct tune_result *)a;
+    const struct tune_result *r2 = (const struct tune_result *)b;
+
+    return (r1->cost > r2->cost) - (r1->cost < r2->cost);
+}
+
+static void print_results(const struct tune_result *results, int num, const struct tune_result *current) {
+    printf("%-8s %-8s %-8s %-6s %-6s %-12s %-10s %-8s %-8s\n",
+           "day", "night", "event", "frames", "drop", "captures/d", "writes/d", "error%", "cost");
+    for (int i = -1; i < num && i < TOP_RESULTS; i++) {
+        const struct tune_result *r = i == -1 ? current : &results[i];
+        printf("%-8d %-8d %-8d %-6d %-6.2lf %-12.1lf %-10.1lf %-8.2lf %-8.2lf%s\n",
+               r->p.timeout[DAY], r->p.timeout[NIGHT], r->p.timeout[EVENT], r->p.frames, r->p.drop_limit,
+               r->captures, r->writes, r->error, r->cost, i == -1 ? " (current)" : "");
+    }
+
+    printf("\n## Recommended by clight --tune (%d configurations tried)\n", num);
+    printf("frames = %d;\n", results[0].p.frames);
+    printf("day_timeout = %d;\n", results[0].p.timeout[DAY]);
+    printf("night_timeout = %d;\n", results[0].p.timeout[NIGHT]);
+    printf("event_timeout = %d;\n", results[0].p.timeout[EVENT]);
+    printf("drop_limit = %.2lf;\n", results[0].p.drop_limit);
+}
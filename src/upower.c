@@ -0,0 +1,87 @@
+#include "../inc/upower.h"
+#include "../inc/event.h"
+
+static void upower_cb(void);
+static int upower_changed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int upower_available(void);
+static int get_on_battery(void);
+
+static int battery;                 // whether we are running on battery
+
+/*
+ * Read UPower OnBattery property, then hook upower_changed to UPower PropertiesChanged signals.
+ * This module polls bus fd, to dispatch bus signals even when location module is not doing it.
+ * It is only needed by dpms timeouts management for now.
+ */
+void init_upower(void) {
+    int fd = DONT_POLL_W_ERR;
+
+    if (!conf.manage_dpms) {
+        return;
+    }
+
+    if (upower_available() && get_on_battery() == 0) {
+        struct bus_args args = {
+            .path = "/org/freedesktop/UPower",
+            .interface = "org.freedesktop.DBus.Properties",
+            .member = "PropertiesChanged"
+        };
+        add_match(&args, upower_changed);
+        fd = sd_bus_get_fd(bus);
+        if (battery) {
+            struct event ev = { .type = POWER_SOURCE_CHANGED, .on_battery = battery };
+            publish_event(&ev);
+        }
+    } else {
+        /* upower is not needed by clight to work: do not leave on error */
+        WARN("UPower not available. Power source will be considered AC.\n");
+    }
+    init_module(fd, UPOWER_IX, upower_cb, destroy_upower);
+}
+
+static void upower_cb(void) {
+    int r;
+
+    do {
+        r = bus_process();
+    } while (r > 0);
+}
+
+/*
+ * Any UPower property changed: check if power source changed.
+ */
+static int upower_changed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    int old = battery;
+
+    if (get_on_battery() == 0 && old != battery) {
+        INFO("Power source changed: %s.\n", battery ? "battery" : "AC");
+        struct event ev = { .type = POWER_SOURCE_CHANGED, .on_battery = battery };
+        publish_event(&ev);
+    }
+    return 0;
+}
+
+/*
+ * Check UPower is on bus before using it: calls to a missing service would be fatal errors.
+ */
+static int upower_available(void) {
+    struct bus_args args = {"org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus", "NameHasOwner"};
+    int has_owner = 0;
+
+    bus_call(&has_owner, "b", &args, "s", "org.freedesktop.UPower");
+    return has_owner;
+}
+
+static int get_on_battery(void) {
+    struct bus_args args = {"org.freedesktop.UPower", "/org/freedesktop/UPower", "org.freedesktop.UPower", "OnBattery"};
+
+    return get_property(&args, "b", &battery);
+}
+
+int on_battery(void) {
+    return battery;
+}
+
+void destroy_upower(void) {
+    /* bus fd is closed by destroy_bus */
+}
@@ -1,6 +1,7 @@
-#include "../inc/utils.h"
+#include "../inc/stream.h"
+#include "../inc/stats.h"
 
-static const char *dict[MODULES_NUM] = {"Brightness", "Location", "Gamma", "Signal", "Dpms"};
+static const char *dict[MODULES_NUM] = {"Brightness", "Location", "Gamma", "Signal", "Dpms", "Stream", "Pressure", "Energy", "Dimmer", "Upower", "Inhibit", "Hooks"};
 
 /**
  * Create timer and returns its fd to
@@ -26,12 +27,48 @@ void set_timeout(int sec, int nsec, int fd, int flag) {
     timerValue.it_value.tv_nsec = nsec;
     timerValue.it_interval.tv_sec = 0;
     timerValue.it_interval.tv_nsec = 0;
+    COUNT(TIMER_SET_CNT);
     int r = timerfd_settime(fd, flag, &timerValue, NULL);
     if (r == -1) {
         ERROR("%s\n", strerror(errno));
+    } else {
+        STREAM("timer", "\"module\":\"%s\",\"sec\":%d,\"nsec\":%d,\"abs\":%s",
+               get_module_name(fd), sec, nsec, flag & TFD_TIMER_ABSTIME ? "true" : "false");
     }
 }
 
+/*
+ * Consume an expired timerfd.
+ */
+ssize_t read_timer(int fd) {
+    uint64_t t;
+
+    COUNT(READ_CNT);
+    return read(fd, &t, sizeof(uint64_t));
+}
+
+/*
+ * Returns name of module polling on fd.
+ */
+const char *get_module_name(int fd) {
+    for (int i = 0; i < MODULES_NUM; i++) {
+        if (main_p[i].fd == fd) {
+            return dict[i];
+        }
+    }
+    return "unknown";
+}
+
+/*
+ * Seconds from CLOCK_MONOTONIC: not affected by system time changes.
+ */
+time_t get_monotonic_time(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
 void init_module(int fd, enum modules module, void (*cb)(void), void (*destroy_func)(void)) {
     if (fd == -1) {
         state.quit = 1;